@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Short immutable string in 24 bytes, for per-session names and tokens.
+// Up to INLINE_SIZE characters are kept inline (std::string keeps 15 in
+// 32 bytes), longer ones in one heap block.
+struct CompactString {
+    enum { INLINE_SIZE = 22, TAG = 23, HEAP = 0xff };
+    CompactString()
+    {
+        bytes_[0] = 0;
+        bytes_[TAG] = 0;
+    }
+    CompactString( const std::string& string ) : CompactString()
+    {
+        assign( string.data(), string.size() );
+    }
+    CompactString( const CompactString& other ) : CompactString()
+    {
+        assign( other.data(), other.size() );
+    }
+    CompactString& operator=( const CompactString& other )
+    {
+        if( this != &other ) {
+            assign( other.data(), other.size() );
+        }
+        return *this;
+    }
+    CompactString& operator=( const std::string& string )
+    {
+        assign( string.data(), string.size() );
+        return *this;
+    }
+    ~CompactString()
+    {
+        release();
+    }
+    const char* data() const { return heap() ? heap_data() : bytes_; }
+    const char* c_str() const { return data(); }
+    size_t size() const { return heap() ? heap_size() : uint8_t( bytes_[TAG] ); }
+    bool empty() const { return !size(); }
+    std::string str() const { return std::string( data(), size() ); }
+    bool operator==( const std::string& other ) const
+    {
+        return size() == other.size() && !memcmp( data(), other.data(), size() );
+    }
+    bool operator!=( const std::string& other ) const { return !( *this == other ); }
+private:
+    bool heap() const { return uint8_t( bytes_[TAG] ) == HEAP; }
+    char* heap_data() const
+    {
+        char* data;
+        memcpy( &data, bytes_, sizeof data );
+        return data;
+    }
+    size_t heap_size() const
+    {
+        uint32_t size;
+        memcpy( &size, bytes_ + sizeof( char* ), sizeof size );
+        return size;
+    }
+    void assign( const char* data, size_t size )
+    {
+        release();
+        if( size <= INLINE_SIZE ) {
+            memcpy( bytes_, data, size );
+            bytes_[size] = 0;
+            bytes_[TAG] = size;
+            return;
+        }
+        char* copy = new char[size + 1];
+        memcpy( copy, data, size );
+        copy[size] = 0;
+        uint32_t heap_size = size;
+        memcpy( bytes_, &copy, sizeof copy );
+        memcpy( bytes_ + sizeof copy, &heap_size, sizeof heap_size );
+        bytes_[TAG] = char( HEAP );
+    }
+    void release()
+    {
+        if( heap() ) {
+            delete[] heap_data();
+            bytes_[0] = 0;
+            bytes_[TAG] = 0;
+        }
+    }
+    char bytes_[24];
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "Message.hpp"
+
+// Double-ended queue of frames in one power-of-two ring. Unlike
+// std::deque, which allocates a map and a 512 byte node up front, it
+// takes no memory while empty, and it gives its storage back when it
+// empties after a burst made it grow past SHRINK_CAPACITY.
+struct FrameQueue {
+    enum { MIN_CAPACITY = 4, SHRINK_CAPACITY = 64 };
+    FrameQueue() = default;
+    FrameQueue( const FrameQueue& ) = delete;
+    FrameQueue& operator=( const FrameQueue& ) = delete;
+
+    size_t size() const { return size_; }
+    bool empty() const { return !size_; }
+    Frame& operator[]( size_t index ) { return slots_[( head_ + index ) & ( capacity_ - 1 )]; }
+    const Frame& operator[]( size_t index ) const { return slots_[( head_ + index ) & ( capacity_ - 1 )]; }
+    Frame& front() { return (*this)[0]; }
+    Frame& back() { return (*this)[size_ - 1]; }
+    void push_back( Frame frame )
+    {
+        reserve( size_ + 1 );
+        (*this)[size_] = std::move( frame );
+        ++size_;
+    }
+    void push_front( Frame frame )
+    {
+        reserve( size_ + 1 );
+        head_ = ( head_ - 1 ) & ( capacity_ - 1 );
+        front() = std::move( frame );
+        ++size_;
+    }
+    void pop_front()
+    {
+        front().reset();
+        head_ = ( head_ + 1 ) & ( capacity_ - 1 );
+        --size_;
+        shrink();
+    }
+    void pop_back()
+    {
+        back().reset();
+        --size_;
+        shrink();
+    }
+    void clear()
+    {
+        slots_.reset();
+        head_ = size_ = capacity_ = 0;
+    }
+
+    struct const_iterator {
+        const FrameQueue* queue;
+        size_t index;
+        const Frame& operator*() const { return (*queue)[index]; }
+        const_iterator& operator++() { ++index; return *this; }
+        bool operator!=( const const_iterator& other ) const { return index != other.index; }
+    };
+    const_iterator begin() const { return { this, 0 }; }
+    const_iterator end() const { return { this, size_ }; }
+private:
+    void reserve( size_t size )
+    {
+        if( size <= capacity_ ) {
+            return;
+        }
+        uint32_t capacity = capacity_ ? capacity_ * 2 : uint32_t( MIN_CAPACITY );
+        std::unique_ptr<Frame[]> slots( new Frame[capacity] );
+        for( uint32_t i = 0; i < size_; ++i ) {
+            slots[i] = std::move( (*this)[i] );
+        }
+        slots_ = std::move( slots );
+        capacity_ = capacity;
+        head_ = 0;
+    }
+    void shrink()
+    {
+        if( !size_ && capacity_ > SHRINK_CAPACITY ) {
+            clear();
+        }
+    }
+    std::unique_ptr<Frame[]> slots_;
+    uint32_t head_ = 0;
+    uint32_t size_ = 0;
+    uint32_t capacity_ = 0;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Log.hpp"
+
+// Records exchanged over the hot restart Unix socket. Every record is
+//   uint32 size, size bytes of payload
+// and may carry one file descriptor (SCM_RIGHTS) attached to its size
+// field. A zero size record ends the stream.
+struct Handoff {
+    static bool make_address( const std::string& path, sockaddr_un& address )
+    {
+        if( path.size() >= sizeof address.sun_path ) {
+            LL("handoff: path too long %s", path.c_str());
+            return false;
+        }
+        memset( &address, 0, sizeof address );
+        address.sun_family = AF_UNIX;
+        memcpy( address.sun_path, path.c_str(), path.size() );
+        return true;
+    }
+    // connects to a running server, -1 if there is none
+    static int connect( const std::string& path )
+    {
+        sockaddr_un address;
+        if( !make_address( path, address ) ) {
+            return -1;
+        }
+        int fd = ::socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+        if( fd < 0 ) {
+            return -1;
+        }
+        if( ::connect( fd, reinterpret_cast<sockaddr*>( &address ), sizeof address ) < 0 ) {
+            ::close( fd );
+            return -1;
+        }
+        return fd;
+    }
+    static bool send( int socket, const std::string& payload, int fd = -1 )
+    {
+        uint32_t size = payload.size();
+        iovec iov{ &size, sizeof size };
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE( sizeof( int ) )] = {};
+        if( fd >= 0 ) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof control;
+            auto cmsg = CMSG_FIRSTHDR( &msg );
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN( sizeof( int ) );
+            memcpy( CMSG_DATA( cmsg ), &fd, sizeof fd );
+        }
+        if( ::sendmsg( socket, &msg, MSG_NOSIGNAL ) != sizeof size ) {
+            LL("handoff: send error: %s", strerror( errno ));
+            return false;
+        }
+        return write_all( socket, payload.data(), payload.size() );
+    }
+    // an empty payload marks the end of the stream
+    static bool receive( int socket, std::string& payload, int& fd )
+    {
+        uint32_t size = 0;
+        iovec iov{ &size, sizeof size };
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        char control[CMSG_SPACE( sizeof( int ) )];
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        fd = -1;
+        if( ::recvmsg( socket, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC ) != sizeof size ) {
+            LL("handoff: receive error");
+            return false;
+        }
+        for( auto cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) ) {
+            if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+                memcpy( &fd, CMSG_DATA( cmsg ), sizeof fd );
+            }
+        }
+        payload.resize( size );
+        return !size || read_all( socket, &payload[0], size );
+    }
+    static bool write_all( int socket, const char* data, size_t size )
+    {
+        while( size ) {
+            auto written = ::send( socket, data, size, MSG_NOSIGNAL );
+            if( written < 0 && errno == EINTR ) {
+                continue;
+            }
+            if( written <= 0 ) {
+                LL("handoff: write error: %s", strerror( errno ));
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+    static bool read_all( int socket, char* data, size_t size )
+    {
+        while( size ) {
+            auto count = ::read( socket, data, size );
+            if( count < 0 && errno == EINTR ) {
+                continue;
+            }
+            if( count <= 0 ) {
+                LL("handoff: read error");
+                return false;
+            }
+            data += count;
+            size -= count;
+        }
+        return true;
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "Message.hpp"
+
+// Fixed-capacity ring of already serialized frames, bounded both by
+// number of frames and by total bytes. Frames are shared, so replaying
+// them to a joining session copies neither bytes nor protobuf objects.
+struct History {
+    History( size_t max_count, size_t max_bytes )
+        : frames_( max_count ), max_bytes_( max_bytes )
+    {}
+    void push( const Frame& frame )
+    {
+        if( frames_.empty() || frame->size() > max_bytes_ ) {
+            return;
+        }
+        while( count_ == frames_.size() || bytes_ + frame->size() > max_bytes_ ) {
+            pop();
+        }
+        frames_[( head_ + count_ ) % frames_.size()] = frame;
+        bytes_ += frame->size();
+        ++count_;
+    }
+    // oldest first
+    std::vector<Frame> frames() const
+    {
+        std::vector<Frame> result;
+        result.reserve( count_ );
+        for( size_t i = 0; i < count_; ++i ) {
+            result.push_back( frames_[( head_ + i ) % frames_.size()] );
+        }
+        return result;
+    }
+    size_t size() const { return count_; }
+    size_t bytes() const { return bytes_; }
+private:
+    void pop()
+    {
+        auto& slot = frames_[head_];
+        bytes_ -= slot->size();
+        slot.reset();
+        head_ = ( head_ + 1 ) % frames_.size();
+        --count_;
+    }
+    std::vector<Frame> frames_;
+    size_t max_bytes_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+    size_t bytes_ = 0;
+};
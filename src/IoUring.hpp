@@ -0,0 +1,336 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <sys/uio.h>
+#include <boost/asio.hpp>
+#include "Recycler.hpp"
+#include "Log.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CHAT_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Socket I/O through io_uring, driven from the asio event loop: the
+// completion queue signals an eventfd that asio waits on. Submissions
+// made while handlers run are batched and entered with one syscall per
+// loop iteration. Accepts are multishot. create() returns null where
+// io_uring is not available, and callers keep using the asio reactor.
+// Callbacks are any callable taking ( int result, unsigned flags ): the
+// syscall result or -errno, and IORING_CQE_F_* flags. They are stored
+// with their operation in memory from the Recycler.
+struct IoUring {
+    using Buffers = std::vector<iovec, RecyclingAllocator<iovec> >;
+    // an accept callback is called again later
+    static bool more( unsigned flags )
+    {
+#ifdef CHAT_HAS_IO_URING
+        return flags & IORING_CQE_F_MORE;
+#else
+        return false;
+#endif
+    }
+
+#ifdef CHAT_HAS_IO_URING
+    static std::unique_ptr<IoUring> create( boost::asio::io_service& io_service, unsigned entries )
+    {
+        std::unique_ptr<IoUring> ring( new IoUring( io_service ) );
+        if( !ring->setup( entries ) ) {
+            LL("uring: not available: %s", strerror( errno ));
+            return nullptr;
+        }
+        ring->wait_completions();
+        return ring;
+    }
+    IoUring( const IoUring& ) = delete;
+    IoUring& operator=( const IoUring& ) = delete;
+    ~IoUring()
+    {
+        if( sqes_ ) {
+            ::munmap( sqes_, sqes_size_ );
+        }
+        if( cq_mapping_ && cq_mapping_ != sq_mapping_ ) {
+            ::munmap( cq_mapping_, cq_mapping_size_ );
+        }
+        if( sq_mapping_ ) {
+            ::munmap( sq_mapping_, sq_mapping_size_ );
+        }
+        if( fd_ >= 0 ) {
+            ::close( fd_ );
+        }
+    }
+    // calls back once per accepted socket until an error ends it
+    template <typename Callback>
+    void accept( int fd, Callback callback )
+    {
+        auto sqe = prepare( IORING_OP_ACCEPT, fd, make_operation( std::move( callback ) ) );
+        if( !sqe ) {
+            return;
+        }
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+    // calls back once the descriptor is readable
+    template <typename Callback>
+    void poll( int fd, Callback callback )
+    {
+        auto sqe = prepare( IORING_OP_POLL_ADD, fd, make_operation( std::move( callback ) ) );
+        if( !sqe ) {
+            return;
+        }
+        sqe->poll32_events = POLLIN;
+    }
+    template <typename Callback>
+    void recv( int fd, void* buffer, size_t size, Callback callback )
+    {
+        auto sqe = prepare( IORING_OP_RECV, fd, make_operation( std::move( callback ) ) );
+        if( !sqe ) {
+            return;
+        }
+        sqe->addr = reinterpret_cast<uint64_t>( buffer );
+        sqe->len = size;
+    }
+    // the buffers must stay valid until the callback
+    template <typename Callback>
+    void send( int fd, Buffers buffers, Callback callback )
+    {
+        auto operation = make_operation( std::move( callback ) );
+        operation->buffers = std::move( buffers );
+        operation->header.msg_iov = operation->buffers.data();
+        operation->header.msg_iovlen = operation->buffers.size();
+        auto sqe = prepare( IORING_OP_SENDMSG, fd, operation );
+        if( !sqe ) {
+            return;
+        }
+        sqe->addr = reinterpret_cast<uint64_t>( &operation->header );
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    // Cancels every operation on the descriptor; they complete with
+    // -ECANCELED. Entered at once, so the descriptor may be closed next.
+    void cancel( int fd )
+    {
+        auto sqe = prepare( IORING_OP_ASYNC_CANCEL, fd, nullptr );
+        if( !sqe ) {
+            return;
+        }
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        submit();
+    }
+    // runs the callbacks of operations that already completed
+    void run_completions()
+    {
+        reap();
+    }
+private:
+    struct Operation {
+        virtual ~Operation() = default;
+        virtual void complete( int result, unsigned flags ) = 0;
+        static void* operator new( size_t size ) { return Recycler::local().allocate( size ); }
+        static void operator delete( void* pointer, size_t size ) { Recycler::local().deallocate( pointer, size ); }
+        Buffers buffers;
+        msghdr header{};
+    };
+    template <typename Callback>
+    struct CallbackOperation : Operation {
+        explicit CallbackOperation( Callback callback ) : callback( std::move( callback ) ) {}
+        void complete( int result, unsigned flags ) override { callback( result, flags ); }
+        Callback callback;
+    };
+    template <typename Callback>
+    static Operation* make_operation( Callback callback )
+    {
+        return new CallbackOperation<Callback>( std::move( callback ) );
+    }
+    IoUring( boost::asio::io_service& io_service )
+        : io_service_( io_service ), event_( io_service )
+    {}
+    bool setup( unsigned entries )
+    {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_SUBMIT_ALL;
+        fd_ = ::syscall( __NR_io_uring_setup, entries, &params );
+        if( fd_ < 0 ) {
+            return false;
+        }
+        sq_mapping_size_ = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+        cq_mapping_size_ = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+        if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+            sq_mapping_size_ = cq_mapping_size_ = std::max( sq_mapping_size_, cq_mapping_size_ );
+        }
+        sq_mapping_ = map( sq_mapping_size_, IORING_OFF_SQ_RING );
+        cq_mapping_ = params.features & IORING_FEAT_SINGLE_MMAP ? sq_mapping_ : map( cq_mapping_size_, IORING_OFF_CQ_RING );
+        sqes_size_ = params.sq_entries * sizeof( io_uring_sqe );
+        sqes_ = static_cast<io_uring_sqe*>( map( sqes_size_, IORING_OFF_SQES ) );
+        if( !sq_mapping_ || !cq_mapping_ || !sqes_ ) {
+            return false;
+        }
+        auto sq = static_cast<char*>( sq_mapping_ );
+        sq_head_ = reinterpret_cast<unsigned*>( sq + params.sq_off.head );
+        sq_tail_ = reinterpret_cast<unsigned*>( sq + params.sq_off.tail );
+        sq_mask_ = *reinterpret_cast<unsigned*>( sq + params.sq_off.ring_mask );
+        sq_flags_ = reinterpret_cast<unsigned*>( sq + params.sq_off.flags );
+        sq_array_ = reinterpret_cast<unsigned*>( sq + params.sq_off.array );
+        sq_entries_ = params.sq_entries;
+        auto cq = static_cast<char*>( cq_mapping_ );
+        cq_head_ = reinterpret_cast<unsigned*>( cq + params.cq_off.head );
+        cq_tail_ = reinterpret_cast<unsigned*>( cq + params.cq_off.tail );
+        cq_mask_ = *reinterpret_cast<unsigned*>( cq + params.cq_off.ring_mask );
+        cqes_ = reinterpret_cast<io_uring_cqe*>( cq + params.cq_off.cqes );
+        int event = ::eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        if( event < 0 ) {
+            return false;
+        }
+        event_.assign( event );
+        return ::syscall( __NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &event, 1 ) == 0;
+    }
+    void* map( size_t size, off_t offset )
+    {
+        void* mapping = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset );
+        return mapping == MAP_FAILED ? nullptr : mapping;
+    }
+    // Takes the next submission queue entry. If the queue stays full
+    // because the kernel refuses the pending entries, the operation fails
+    // with -EBUSY instead, and its callback runs from the event loop.
+    io_uring_sqe* prepare( int opcode, int fd, Operation* operation )
+    {
+        auto tail = *sq_tail_;
+        if( tail - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) == sq_entries_ ) {
+            submit();
+            if( tail - __atomic_load_n( sq_head_, __ATOMIC_ACQUIRE ) == sq_entries_ ) {
+                LL("uring: submission queue full");
+                if( operation ) {
+                    boost::asio::post( io_service_, recycled( [operation]() {
+                            std::unique_ptr<Operation> done( operation );
+                            done->complete( -EBUSY, 0 );
+                        } ) );
+                }
+                return nullptr;
+            }
+        }
+        auto index = tail & sq_mask_;
+        auto sqe = &sqes_[index];
+        memset( sqe, 0, sizeof *sqe );
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = reinterpret_cast<uint64_t>( operation );
+        sq_array_[index] = index;
+        __atomic_store_n( sq_tail_, tail + 1, __ATOMIC_RELEASE );
+        ++pending_;
+        if( !submit_scheduled_ ) {
+            submit_scheduled_ = true;
+            boost::asio::post( io_service_, recycled( [this]() { submit(); } ) );
+        }
+        return sqe;
+    }
+    void submit()
+    {
+        submit_scheduled_ = false;
+        while( pending_ ) {
+            auto submitted = ::syscall( __NR_io_uring_enter, fd_, pending_, 0, 0, nullptr, 0 );
+            if( submitted < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                if( errno == EAGAIN || errno == EBUSY ) {
+                    // completion queue is full: reap, then retry
+                    reap();
+                    continue;
+                }
+                LL("uring: submit error: %s", strerror( errno ));
+                return;
+            }
+            pending_ -= submitted;
+        }
+    }
+    void wait_completions()
+    {
+        event_.async_read_some( boost::asio::buffer( &events_, sizeof events_ ), recycled(
+            [this]( std::error_code ec, size_t ) {
+                if( ec ) {
+                    LL("uring: eventfd error: %s", ec.message().c_str());
+                    return;
+                }
+                reap();
+                wait_completions();
+            } ) );
+    }
+    void reap()
+    {
+        for( ;; ) {
+            auto head = *cq_head_;
+            auto tail = __atomic_load_n( cq_tail_, __ATOMIC_ACQUIRE );
+            if( head == tail ) {
+                if( __atomic_load_n( sq_flags_, __ATOMIC_RELAXED ) & IORING_SQ_CQ_OVERFLOW ) {
+                    ::syscall( __NR_io_uring_enter, fd_, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0 );
+                    continue;
+                }
+                return;
+            }
+            for( ; head != tail; ++head ) {
+                auto cqe = cqes_[head & cq_mask_];
+                // consumed before the callback, which may submit more
+                __atomic_store_n( cq_head_, head + 1, __ATOMIC_RELEASE );
+                auto operation = reinterpret_cast<Operation*>( cqe.user_data );
+                if( !operation ) {
+                    continue;
+                }
+                if( cqe.flags & IORING_CQE_F_MORE ) {
+                    operation->complete( cqe.res, cqe.flags );
+                } else {
+                    std::unique_ptr<Operation> done( operation );
+                    done->complete( cqe.res, cqe.flags );
+                }
+            }
+        }
+    }
+    boost::asio::io_service& io_service_;
+    int fd_ = -1;
+    void* sq_mapping_ = nullptr;
+    void* cq_mapping_ = nullptr;
+    size_t sq_mapping_size_ = 0;
+    size_t cq_mapping_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_flags_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+    unsigned pending_ = 0;
+    bool submit_scheduled_ = false;
+    boost::asio::posix::stream_descriptor event_;
+    uint64_t events_;
+#else
+    static std::unique_ptr<IoUring> create( boost::asio::io_service&, unsigned )
+    {
+        LL("uring: not supported by this build");
+        return nullptr;
+    }
+    template <typename Callback>
+    void accept( int, Callback ) {}
+    template <typename Callback>
+    void poll( int, Callback ) {}
+    template <typename Callback>
+    void recv( int, void*, size_t, Callback ) {}
+    template <typename Callback>
+    void send( int, Buffers, Callback ) {}
+    void cancel( int ) {}
+    void run_completions() {}
+#endif
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Log.hpp"
+
+// Sparse (sequence, timestamp) -> file offset index over message log
+// segments. Every segment has an ".idx" sidecar holding one entry per
+// index_bytes of log data. Sidecars of sealed segments are memory-mapped
+// at startup; entries of segments written by this process are kept in
+// memory and appended to their sidecar as the writer commits.
+struct LogIndex {
+    struct Entry {
+        uint64_t sequence;
+        uint64_t timestamp;
+        uint64_t offset;
+    };
+    struct Position {
+        std::string path;
+        uint64_t offset;
+    };
+
+    LogIndex() = default;
+    LogIndex( const LogIndex& ) = delete;
+    LogIndex& operator=( const LogIndex& ) = delete;
+    ~LogIndex()
+    {
+        for( auto& segment: segments_ ) {
+            if( segment.mapping ) {
+                ::munmap( segment.mapping, segment.mapping_size );
+            }
+            if( segment.fd >= 0 ) {
+                ::close( segment.fd );
+            }
+        }
+    }
+    static std::string index_path( const std::string& log_path )
+    {
+        return log_path.substr( 0, log_path.size() - 4 ) + ".idx";
+    }
+    // maps the sidecar of a segment that will not be written again
+    void map_segment( const std::string& log_path )
+    {
+        Segment segment;
+        segment.path = log_path;
+        int fd = ::open( index_path( log_path ).c_str(), O_RDONLY );
+        struct stat st;
+        if( fd >= 0 && fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof( Entry ) ) {
+            segment.mapping_size = st.st_size - st.st_size % sizeof( Entry );
+            void* mapping = ::mmap( nullptr, segment.mapping_size, PROT_READ, MAP_SHARED, fd, 0 );
+            if( mapping != MAP_FAILED ) {
+                segment.mapping = mapping;
+            } else {
+                LL("index: cannot map %s", log_path.c_str());
+            }
+        }
+        if( fd >= 0 ) {
+            ::close( fd );
+        }
+        std::lock_guard<std::mutex> lock( mutex_ );
+        segments_.push_back( std::move( segment ) );
+    }
+    // starts a segment that the writer appends to
+    void open_segment( const std::string& log_path )
+    {
+        Segment segment;
+        segment.path = log_path;
+        segment.fd = ::open( index_path( log_path ).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if( segment.fd < 0 ) {
+            LL("index: cannot open index of %s", log_path.c_str());
+        }
+        std::lock_guard<std::mutex> lock( mutex_ );
+        if( segments_.size() && segments_.back().fd >= 0 ) {
+            ::close( segments_.back().fd );
+            segments_.back().fd = -1;
+        }
+        segments_.push_back( std::move( segment ) );
+    }
+    // adds an entry to the newest segment
+    void append( const Entry& entry )
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        auto& segment = segments_.back();
+        if( segment.fd >= 0 && ::pwrite( segment.fd, &entry, sizeof entry, segment.entries.size() * sizeof entry ) < 0 ) {
+            LL("index: write error");
+        }
+        segment.entries.push_back( entry );
+    }
+    // Position of the latest indexed record older than the timestamp, so
+    // a scan from there sees records of the same millisecond written
+    // before the next entry. Two binary searches: over segments, then over
+    // one segment's entries.
+    bool find( uint64_t timestamp, Position& position ) const
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        auto segment = std::lower_bound( segments_.begin(), segments_.end(), timestamp,
+                                         []( const Segment& segment, uint64_t timestamp ) {
+                                             return segment.size() && segment.begin()->timestamp < timestamp;
+                                         } );
+        if( segment != segments_.begin() ) {
+            --segment;
+        }
+        // a segment the writer has just started has nothing indexed yet
+        while( segment != segments_.begin() && segment != segments_.end() && !segment->size() ) {
+            --segment;
+        }
+        if( segment == segments_.end() ) {
+            return false;
+        }
+        auto entry = std::lower_bound( segment->begin(), segment->end(), timestamp,
+                                       []( const Entry& entry, uint64_t timestamp ) {
+                                           return entry.timestamp < timestamp;
+                                       } );
+        position.path = segment->path;
+        position.offset = entry == segment->begin() ? 0 : ( entry - 1 )->offset;
+        return true;
+    }
+    // log path of the segment following the given one, empty if none
+    std::string next( const std::string& log_path ) const
+    {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        for( size_t i = 0; i + 1 < segments_.size(); ++i ) {
+            if( segments_[i].path == log_path ) {
+                return segments_[i + 1].path;
+            }
+        }
+        return {};
+    }
+private:
+    struct Segment {
+        std::string path;
+        void* mapping = nullptr;
+        size_t mapping_size = 0;
+        std::vector<Entry> entries;
+        int fd = -1;
+        const Entry* begin() const
+        {
+            return mapping ? static_cast<const Entry*>( mapping ) : entries.data();
+        }
+        const Entry* end() const { return begin() + size(); }
+        size_t size() const
+        {
+            return mapping ? mapping_size / sizeof( Entry ) : entries.size();
+        }
+    };
+    mutable std::mutex mutex_;
+    std::vector<Segment> segments_;
+};
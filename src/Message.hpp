@@ -1,6 +1,49 @@
 #pragma once
 
+#include <cstring>
 #include "Log.hpp"
+#include "Recycler.hpp"
+#include "RefCount.hpp"
+
+// Wire-ready frame (header and body) shared between all its recipients.
+// A frame is one block, reference count in front of the bytes, from a
+// per-thread recycler of its own, so its stats count the frames taken
+// from the system.
+struct FramePool {
+    static const Recycler::Stats& stats() { return Recycler::local<FramePool>().stats(); }
+};
+struct FrameBuffer;
+using Frame = boost::intrusive_ptr<const FrameBuffer>;
+
+struct FrameBuffer {
+    static Frame create( const char* data, size_t size )
+    {
+        auto frame = new( Recycler::local<FramePool>().allocate( sizeof( FrameBuffer ) + size ) ) FrameBuffer( size );
+        memcpy( const_cast<char*>( frame->data() ), data, size );
+        return Frame( frame );
+    }
+    const char* data() const { return reinterpret_cast<const char*>( this + 1 ); }
+    size_t size() const { return size_; }
+    friend void intrusive_ptr_add_ref( const FrameBuffer* frame )
+    {
+        RefCount::increment( frame->count_ );
+    }
+    friend void intrusive_ptr_release( const FrameBuffer* frame )
+    {
+        if( !RefCount::decrement( frame->count_ ) ) {
+            Recycler::local<FramePool>().deallocate( const_cast<FrameBuffer*>( frame ), sizeof( FrameBuffer ) + frame->size_ );
+        }
+    }
+private:
+    explicit FrameBuffer( size_t size ) : count_( 0 ), size_( size ) {}
+    mutable RefCount::type count_;
+    uint32_t size_;
+};
+
+inline Frame make_frame( const char* data, size_t size )
+{
+    return FrameBuffer::create( data, size );
+}
 
 struct Message {
     Message() = default;
@@ -41,10 +84,14 @@ struct Message {
         memcpy( body(), buffer.data(), buffer.size() );
         return true;
     }
+    Frame frame() const
+    {
+        return make_frame( data(), size() );
+    }
     bool parse()
     {
         LL("parsing message...");
-        return (serialized_ = message_body_.ParseFromString( std::string( body(), body_size() ) ) );
+        return (serialized_ = message_body_.ParseFromArray( body(), body_size() ) );
     }
     MessageBody::Type type() const
     {
@@ -58,6 +105,72 @@ struct Message {
     {
         return message_body_.text();
     }
+    std::string room() const
+    {
+        return message_body_.room();
+    }
+    std::string recipient() const
+    {
+        return message_body_.recipient();
+    }
+    uint64_t since() const
+    {
+        return message_body_.since();
+    }
+    uint64_t until() const
+    {
+        return message_body_.until();
+    }
+    bool has_until() const
+    {
+        return message_body_.has_until();
+    }
+    std::string token() const
+    {
+        return message_body_.token();
+    }
+    uint64_t sequence() const
+    {
+        return message_body_.sequence();
+    }
+    bool has_ack() const
+    {
+        return message_body_.has_ack();
+    }
+    uint64_t ack() const
+    {
+        return message_body_.ack();
+    }
+    bool reliable() const
+    {
+        return message_body_.reliable();
+    }
+    uint32_t retry_milliseconds() const
+    {
+        return message_body_.retry_milliseconds();
+    }
+    const MessageBody& message_body() const { return message_body_; }
+    std::string origin() const
+    {
+        return message_body_.origin();
+    }
+    uint64_t origin_sequence() const
+    {
+        return message_body_.origin_sequence();
+    }
+    // tags a frame relayed to other servers
+    bool set_origin( const std::string& origin, uint64_t sequence )
+    {
+        message_body_.set_origin( origin );
+        message_body_.set_origin_sequence( sequence );
+        return serialized_ = serialize();
+    }
+    // piggybacks a cumulative acknowledgement on an outgoing message
+    bool acknowledge( uint64_t ack )
+    {
+        message_body_.set_ack( ack );
+        return serialized_ = serialize();
+    }
     bool serialized() const { return serialized_; }
 protected:
     char data_[HEADER_SIZE + MAX_BODY_SIZE];
@@ -67,9 +180,12 @@ protected:
 };
 
 struct AddMessage : public Message {
-    AddMessage( const std::string& nickname )
+    AddMessage( const std::string& nickname, bool reliable = false )
         : Message( nickname, MessageBody::ADD )
     {
+        if( reliable ) {
+            message_body_.set_reliable( true );
+        }
         serialized_ = serialize();
     }
 };
@@ -99,10 +215,154 @@ struct RemoveDisconnectedMessage : public Message {
 };
 
 struct TextMessage : public Message {
-    TextMessage( const std::string& nickname, const std::string& text )
+    TextMessage( const std::string& nickname, const std::string& text, const std::string& room = "" )
         : Message( nickname, MessageBody::TEXT )
     {
         message_body_.set_text( text );
+        if( !room.empty() ) {
+            message_body_.set_room( room );
+        }
+        serialized_ = serialize();
+    }
+};
+
+struct DirectMessage : public Message {
+    DirectMessage( const std::string& nickname, const std::string& recipient, const std::string& text )
+        : Message( nickname, MessageBody::TEXT )
+    {
+        message_body_.set_text( text );
+        message_body_.set_recipient( recipient );
+        serialized_ = serialize();
+    }
+};
+
+struct JoinMessage : public Message {
+    JoinMessage( const std::string& nickname, const std::string& room )
+        : Message( nickname, MessageBody::JOIN )
+    {
+        message_body_.set_room( room );
+        serialized_ = serialize();
+    }
+};
+
+struct LeaveMessage : public Message {
+    LeaveMessage( const std::string& nickname, const std::string& room )
+        : Message( nickname, MessageBody::LEAVE )
+    {
+        message_body_.set_room( room );
+        serialized_ = serialize();
+    }
+};
+
+struct HistoryMessage : public Message {
+    // until == 0 requests everything since the given time
+    HistoryMessage( const std::string& nickname, uint64_t since, uint64_t until = 0 )
+        : Message( nickname, MessageBody::HISTORY )
+    {
+        message_body_.set_since( since );
+        if( until ) {
+            message_body_.set_until( until );
+        }
+        serialized_ = serialize();
+    }
+};
+
+// sent by the server once a nickname is accepted
+struct SessionMessage : public Message {
+    SessionMessage( const std::string& nickname, const std::string& token, uint64_t sequence )
+        : Message( nickname, MessageBody::SESSION )
+    {
+        message_body_.set_token( token );
+        message_body_.set_sequence( sequence );
+        serialized_ = serialize();
+    }
+};
+
+struct ResumeMessage : public Message {
+    ResumeMessage( const std::string& nickname, const std::string& token, uint64_t sequence, bool reliable = false )
+        : Message( nickname, MessageBody::RESUME )
+    {
+        message_body_.set_token( token );
+        message_body_.set_sequence( sequence );
+        if( reliable ) {
+            message_body_.set_reliable( true );
+        }
+        serialized_ = serialize();
+    }
+};
+
+struct AckMessage : public Message {
+    AckMessage( const std::string& nickname, uint64_t ack )
+        : Message( nickname, MessageBody::ACK )
+    {
+        message_body_.set_ack( ack );
+        serialized_ = serialize();
+    }
+};
+
+// Roster delta; changes are added until the frame is full.
+struct PresenceMessage : public Message {
+    PresenceMessage()
+        : Message( "", MessageBody::PRESENCE )
+    {}
+    bool add_joined( const std::string& nickname, uint32_t id )
+    {
+        message_body_.add_joined( nickname );
+        message_body_.add_joined_id( id );
+        if( message_body_.ByteSizeLong() > MAX_BODY_SIZE ) {
+            message_body_.mutable_joined()->RemoveLast();
+            message_body_.mutable_joined_id()->RemoveLast();
+            return false;
+        }
+        return true;
+    }
+    bool add_left( MessageBody::Type reason, uint32_t id )
+    {
+        auto field = reason == MessageBody::INACTIVITY ? message_body_.mutable_inactive()
+            : message_body_.mutable_disconnected();
+        field->Add( id );
+        if( message_body_.ByteSizeLong() > MAX_BODY_SIZE ) {
+            field->RemoveLast();
+            return false;
+        }
+        return true;
+    }
+    bool empty() const
+    {
+        return !message_body_.joined_size() && !message_body_.inactive_size() && !message_body_.disconnected_size();
+    }
+    bool finish()
+    {
+        return serialized_ = serialize();
+    }
+};
+
+struct RosterMessage : public Message {
+    RosterMessage( const std::string& roster )
+        : Message( "", MessageBody::ROSTER )
+    {
+        message_body_.set_roster( roster );
+        serialized_ = serialize();
+    }
+};
+
+// first frame on a server-to-server link
+struct PeerMessage : public Message {
+    PeerMessage( const std::string& node )
+        : Message( "", MessageBody::PEER )
+    {
+        message_body_.set_origin( node );
+        serialized_ = serialize();
+    }
+};
+
+struct ShutdownMessage : public Message {
+    ShutdownMessage( uint32_t retry_milliseconds = 0 )
+        : Message( "", MessageBody::SHUTDOWN )
+    {
+        if( retry_milliseconds ) {
+            message_body_.set_retry_milliseconds( retry_milliseconds );
+        }
         serialized_ = serialize();
     }
 };
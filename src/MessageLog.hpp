@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "Message.hpp"
+#include "LogIndex.hpp"
+#include "Log.hpp"
+
+// Append-only durable log of relayed frames.
+//
+// The event loop only copies the frame into a pending batch; a writer
+// thread appends batches to segment files with pwritev and commits them
+// with a single fdatasync once either the latency or the byte budget is
+// exhausted (group commit). Segments are named after the sequence number
+// of their first record and carry a sparse index for time range reads.
+struct MessageLog {
+    struct Config {
+        std::string directory;
+        size_t segment_bytes = 64 * 1024 * 1024;
+        size_t sync_bytes = 64 * 1024;
+        unsigned sync_milliseconds = 10;
+        size_t index_bytes = 4096;
+    };
+    // on-disk header preceding every frame
+    struct Record {
+        uint32_t size;
+        uint32_t reserved;
+        uint64_t sequence;
+        uint64_t timestamp;     // milliseconds since epoch
+    };
+
+    MessageLog( const Config& config )
+        : config_( config )
+    {
+        std::filesystem::create_directories( config_.directory );
+        recover();
+        writer_ = std::thread( [this] { run(); } );
+    }
+    ~MessageLog()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            stopped_ = true;
+        }
+        condition_.notify_one();
+        writer_.join();
+        if( fd_ >= 0 ) {
+            ::close( fd_ );
+        }
+    }
+    // returns the sequence number assigned to the frame
+    uint64_t append( const Message& message )
+    {
+        Record record;
+        record.size = message.size();
+        record.reserved = 0;
+        record.sequence = next_sequence_++;
+        record.timestamp = now();
+        bool commit;
+        {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            auto header = reinterpret_cast<const char*>( &record );
+            pending_.insert( pending_.end(), header, header + sizeof record );
+            pending_.insert( pending_.end(), message.data(), message.data() + message.size() );
+            commit = pending_.size() >= config_.sync_bytes;
+        }
+        if( commit ) {
+            condition_.notify_one();
+        }
+        return record.sequence;
+    }
+    uint64_t next_sequence() const { return next_sequence_; }
+    // Committed frames with since <= timestamp <= until accepted by the
+    // filter, oldest first. Blocks on disk reads, so keep it off the
+    // event loop.
+    std::vector<std::string> read( uint64_t since, uint64_t until, size_t limit,
+                                   const std::function<bool( const char*, size_t )>& filter ) const
+    {
+        std::vector<std::string> result;
+        LogIndex::Position position;
+        if( !index_.find( since, position ) ) {
+            return result;
+        }
+        auto path = position.path;
+        auto offset = position.offset;
+        bool done = false;
+        while( !done && !path.empty() && result.size() < limit ) {
+            int fd = ::open( path.c_str(), O_RDONLY );
+            if( fd < 0 ) {
+                LL("log: cannot open %s", path.c_str());
+                break;
+            }
+            Record record;
+            char frame[Message::HEADER_SIZE + Message::MAX_BODY_SIZE];
+            while( result.size() < limit
+                   && ::pread( fd, &record, sizeof record, offset ) == sizeof record
+                   && record.size <= sizeof frame
+                   && ::pread( fd, frame, record.size, offset + sizeof record ) == record.size ) {
+                offset += sizeof record + record.size;
+                if( record.timestamp > until ) {
+                    done = true;
+                    break;
+                }
+                if( record.timestamp >= since && filter( frame, record.size ) ) {
+                    result.emplace_back( frame, record.size );
+                }
+            }
+            ::close( fd );
+            path = index_.next( path );
+            offset = 0;
+        }
+        return result;
+    }
+    static uint64_t now()
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>( system_clock::now().time_since_epoch() ).count();
+    }
+    static std::string segment_name( uint64_t sequence )
+    {
+        char name[32];
+        snprintf( name, sizeof name, "%020llu.log", (unsigned long long)sequence );
+        return name;
+    }
+    // segment paths ordered by first sequence number
+    static std::vector<std::filesystem::path> segments( const std::string& directory )
+    {
+        std::vector<std::filesystem::path> result;
+        for( auto& entry: std::filesystem::directory_iterator( directory ) ) {
+            if( entry.path().extension() == ".log" ) {
+                result.push_back( entry.path() );
+            }
+        }
+        std::sort( result.begin(), result.end() );
+        return result;
+    }
+private:
+    // Finds the tail of the newest segment, drops a torn last record and
+    // continues numbering after the last complete one.
+    void recover()
+    {
+        auto paths = segments( config_.directory );
+        if( paths.empty() ) {
+            return;
+        }
+        for( size_t i = 0; i + 1 < paths.size(); ++i ) {
+            index_.map_segment( paths[i].string() );
+        }
+        auto path = paths.back();
+        int fd = ::open( path.c_str(), O_RDONLY );
+        if( fd < 0 ) {
+            throw std::runtime_error( "cannot open " + path.string() );
+        }
+        next_sequence_ = std::stoull( path.stem().string() );
+        open_segment( path );
+        off_t offset = 0;
+        Record record;
+        while( ::pread( fd, &record, sizeof record, offset ) == sizeof record
+               && record.size <= Message::HEADER_SIZE + Message::MAX_BODY_SIZE ) {
+            struct stat st;
+            if( fstat( fd, &st ) < 0 || offset + (off_t)( sizeof record + record.size ) > st.st_size ) {
+                break;
+            }
+            next_sequence_ = record.sequence + 1;
+            index( record, offset );
+            offset += sizeof record + record.size;
+        }
+        ::close( fd );
+        LL("log: recovered %s, next sequence %llu", path.c_str(), (unsigned long long)next_sequence_);
+        if( ::ftruncate( fd_, offset ) < 0 ) {
+            LL("log: cannot truncate %s", path.c_str());
+        }
+        offset_ = offset;
+    }
+    // indexes the record at the given segment offset if it starts a new stride
+    void index( const Record& record, uint64_t offset )
+    {
+        if( offset >= next_index_offset_ ) {
+            index_.append( { record.sequence, record.timestamp, offset } );
+            next_index_offset_ = offset + config_.index_bytes;
+        }
+    }
+    void open_segment( const std::filesystem::path& path )
+    {
+        if( fd_ >= 0 ) {
+            ::close( fd_ );
+        }
+        fd_ = ::open( path.c_str(), O_WRONLY | O_CREAT, 0644 );
+        if( fd_ < 0 ) {
+            throw std::runtime_error( "cannot open " + path.string() );
+        }
+        offset_ = 0;
+        next_index_offset_ = 0;
+        index_.open_segment( path.string() );
+    }
+    void run()
+    {
+        std::vector<char> batch;
+        std::unique_lock<std::mutex> lock( mutex_ );
+        while( !stopped_ || pending_.size() ) {
+            condition_.wait_for( lock, std::chrono::milliseconds( config_.sync_milliseconds ),
+                                 [this] { return stopped_ || pending_.size() >= config_.sync_bytes; } );
+            if( pending_.empty() ) {
+                continue;
+            }
+            batch.swap( pending_ );
+            lock.unlock();
+            commit( batch );
+            batch.clear();
+            lock.lock();
+        }
+    }
+    void commit( const std::vector<char>& batch )
+    {
+        // a batch may span a segment boundary only at record boundaries
+        std::vector<iovec> chunk;
+        size_t chunk_bytes = 0;
+        for( size_t offset = 0; offset < batch.size(); ) {
+            Record record;
+            memcpy( &record, batch.data() + offset, sizeof record );
+            size_t size = sizeof record + record.size;
+            if( fd_ < 0 || ( offset_ + chunk_bytes > 0 && offset_ + chunk_bytes + size > config_.segment_bytes ) ) {
+                write( chunk, chunk_bytes );
+                open_segment( std::filesystem::path( config_.directory ) / segment_name( record.sequence ) );
+            }
+            unindexed_.push_back( { record, offset_ + chunk_bytes } );
+            chunk.push_back( { const_cast<char*>( batch.data() + offset ), size } );
+            chunk_bytes += size;
+            offset += size;
+        }
+        write( chunk, chunk_bytes );
+    }
+    // Writes the chunk at the end of the segment, resuming short writes
+    // where they stopped. After an error the segment ends at the last
+    // complete record, and only complete records are indexed.
+    void write( std::vector<iovec>& chunk, size_t& chunk_bytes )
+    {
+        if( chunk.empty() ) {
+            return;
+        }
+        off_t end = offset_ + chunk_bytes;
+        for( size_t i = 0; i < chunk.size(); ) {
+            size_t count = std::min<size_t>( IOV_MAX, chunk.size() - i );
+            ssize_t written = ::pwritev( fd_, &chunk[i], count, offset_ );
+            if( written < 0 && errno == EINTR ) {
+                continue;
+            }
+            if( written <= 0 ) {
+                LL("log: write error: %s", written < 0 ? strerror( errno ) : "nothing written");
+                break;
+            }
+            offset_ += written;
+            // skip the buffers written whole, the next one may start midway
+            for( size_t left = written; left; ) {
+                if( left >= chunk[i].iov_len ) {
+                    left -= chunk[i].iov_len;
+                    ++i;
+                } else {
+                    chunk[i].iov_base = static_cast<char*>( chunk[i].iov_base ) + left;
+                    chunk[i].iov_len -= left;
+                    left = 0;
+                }
+            }
+        }
+        size_t complete = 0;
+        for( ; complete < unindexed_.size(); ++complete ) {
+            auto& position = unindexed_[complete];
+            if( off_t( position.second + sizeof position.first + position.first.size ) > offset_ ) {
+                break;
+            }
+        }
+        if( offset_ < end ) {
+            // the next write starts over the torn record
+            off_t torn = complete < unindexed_.size() ? unindexed_[complete].second : offset_;
+            LL("log: %llu records lost", (unsigned long long)( unindexed_.size() - complete ));
+            if( ::ftruncate( fd_, torn ) < 0 ) {
+                LL("log: cannot truncate: %s", strerror( errno ));
+            }
+            offset_ = torn;
+        }
+        if( ::fdatasync( fd_ ) < 0 ) {
+            LL("log: sync error: %s", strerror( errno ));
+        }
+        for( size_t i = 0; i < complete; ++i ) {
+            index( unindexed_[i].first, unindexed_[i].second );
+        }
+        unindexed_.clear();
+        chunk.clear();
+        chunk_bytes = 0;
+    }
+
+    Config config_;
+    std::thread writer_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::vector<char> pending_;
+    bool stopped_ = false;
+    uint64_t next_sequence_ = 0;
+    int fd_ = -1;
+    off_t offset_ = 0;
+    LogIndex index_;
+    uint64_t next_index_offset_ = 0;
+    std::vector<std::pair<Record, uint64_t> > unindexed_;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "Message.hpp"
+
+// Presence changes collected over a short window. A join and a leave of
+// the same nickname inside one window cancel out, so a reconnect storm
+// costs a few shared delta frames per session instead of one message
+// per event per session. Leaves refer to the roster id of the nickname.
+struct Presence {
+    void joined( const std::string& nickname, uint32_t id )
+    {
+        joined_[nickname] = id;
+    }
+    void left( const std::string& nickname, uint32_t id, MessageBody::Type reason )
+    {
+        if( joined_.erase( nickname ) ) {
+            return;
+        }
+        ( reason == MessageBody::INACTIVITY ? inactive_ : disconnected_ ).insert( id );
+    }
+    bool empty() const
+    {
+        return joined_.empty() && inactive_.empty() && disconnected_.empty();
+    }
+    // leaves come first so that a left-and-rejoined nickname ends up online
+    std::vector<Frame> frames()
+    {
+        std::vector<Frame> result;
+        PresenceMessage message;
+        auto flush = [&]() {
+            if( message.finish() ) {
+                result.push_back( message.frame() );
+            }
+            message = PresenceMessage();
+        };
+        for( auto id: disconnected_ ) {
+            if( !message.add_left( MessageBody::DISCONNECTED, id ) ) {
+                flush();
+                message.add_left( MessageBody::DISCONNECTED, id );
+            }
+        }
+        for( auto id: inactive_ ) {
+            if( !message.add_left( MessageBody::INACTIVITY, id ) ) {
+                flush();
+                message.add_left( MessageBody::INACTIVITY, id );
+            }
+        }
+        for( auto& joined: joined_ ) {
+            if( !message.add_joined( joined.first, joined.second ) ) {
+                flush();
+                message.add_joined( joined.first, joined.second );
+            }
+        }
+        if( !message.empty() ) {
+            flush();
+        }
+        joined_.clear();
+        inactive_.clear();
+        disconnected_.clear();
+        return result;
+    }
+private:
+    std::map<std::string, uint32_t> joined_;
+    std::set<uint32_t> inactive_;
+    std::set<uint32_t> disconnected_;
+};
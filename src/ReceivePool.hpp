@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "Message.hpp"
+
+// Receive buffers shared by all sessions of a thread. A session borrows
+// one when its socket becomes readable and gives it back once no frame
+// is left half read, so idle sessions hold no receive memory. Released
+// buffers are kept for reuse up to MAX_FREE.
+struct ReceivePool {
+    enum { MAX_FREE = 1024 };
+    struct Release {
+        void operator()( Message* message ) const { ReceivePool::local().give( message ); }
+    };
+    using Buffer = std::unique_ptr<Message, Release>;
+
+    static ReceivePool& local()
+    {
+        static thread_local ReceivePool pool;
+        return pool;
+    }
+    Buffer take()
+    {
+        if( free_.empty() ) {
+            return Buffer( new Message );
+        }
+        Buffer buffer( free_.back() );
+        free_.pop_back();
+        return buffer;
+    }
+    size_t free() const { return free_.size(); }
+    ~ReceivePool()
+    {
+        for( auto message: free_ ) {
+            delete message;
+        }
+    }
+private:
+    void give( Message* message )
+    {
+        if( free_.size() < MAX_FREE ) {
+            free_.push_back( message );
+        } else {
+            delete message;
+        }
+    }
+    std::vector<Message*> free_;
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Per-thread free lists of memory blocks in 64 byte size classes up to
+// MAX_SIZE. Sessions, frames (a FramePool recycler of their own), send
+// buffer lists and the handler memory asio and IoUring allocate for every
+// read, write and wait take blocks from here and give them back, so once
+// the lists are warm a steady stream of messages does not call malloc.
+// Reference counts are intrusive, there are no control blocks. Blocks
+// stay on the lists once allocated: the recycler keeps its high-water
+// mark. A tag type gives a kind of object a recycler of its own, with its
+// own stats.
+struct Recycler {
+    enum { GRANULE = 64, MAX_SIZE = 1024, CLASSES = MAX_SIZE / GRANULE };
+
+    template <typename Tag = void>
+    static Recycler& local()
+    {
+        static thread_local Recycler recycler;
+        return recycler;
+    }
+    void* allocate( size_t size )
+    {
+        if( size > MAX_SIZE ) {
+            ++stats_.large;
+            return ::operator new( size );
+        }
+        auto& list = free_[size_class( size )];
+        if( !list ) {
+            ++stats_.fresh;
+            reserve( size, 1 );
+        } else {
+            ++stats_.recycled;
+        }
+        auto block = list;
+        list = block->next;
+        return block;
+    }
+    void deallocate( void* pointer, size_t size )
+    {
+        if( size > MAX_SIZE ) {
+            ::operator delete( pointer );
+            return;
+        }
+        auto block = static_cast<Block*>( pointer );
+        auto& list = free_[size_class( size )];
+        block->next = list;
+        list = block;
+    }
+    // carves count blocks for objects of this size from one allocation
+    void reserve( size_t size, size_t count )
+    {
+        if( size > MAX_SIZE || !count ) {
+            return;
+        }
+        auto index = size_class( size );
+        size_t block_size = ( index + 1 ) * GRANULE;
+        chunks_.emplace_back( new char[block_size * count] );
+        auto chunk = chunks_.back().get();
+        for( size_t i = count; i-- > 0; ) {
+            auto block = reinterpret_cast<Block*>( chunk + i * block_size );
+            block->next = free_[index];
+            free_[index] = block;
+        }
+    }
+    struct Stats {
+        uint64_t fresh = 0;     // blocks taken from the system
+        uint64_t recycled = 0;  // blocks served from a free list
+        uint64_t large = 0;     // requests above MAX_SIZE
+    };
+    const Stats& stats() const { return stats_; }
+private:
+    struct Block {
+        Block* next;
+    };
+    static size_t size_class( size_t size )
+    {
+        return size ? ( size - 1 ) / GRANULE : 0;
+    }
+    Block* free_[CLASSES] = {};
+    std::vector<std::unique_ptr<char[]> > chunks_;
+    Stats stats_;
+};
+
+// Standard allocator over the recycler, for allocate_shared, containers
+// and asio's associated allocator.
+template <typename T, typename Tag = void>
+struct RecyclingAllocator {
+    using value_type = T;
+    RecyclingAllocator() = default;
+    template <typename U>
+    RecyclingAllocator( const RecyclingAllocator<U, Tag>& ) {}
+    T* allocate( size_t count )
+    {
+        return static_cast<T*>( Recycler::local<Tag>().allocate( count * sizeof( T ) ) );
+    }
+    void deallocate( T* pointer, size_t count )
+    {
+        Recycler::local<Tag>().deallocate( pointer, count * sizeof( T ) );
+    }
+    template <typename U>
+    bool operator==( const RecyclingAllocator<U, Tag>& ) const { return true; }
+    template <typename U>
+    bool operator!=( const RecyclingAllocator<U, Tag>& ) const { return false; }
+};
+
+// Wraps an asio completion handler so the operation holding it is
+// allocated from the recycler.
+template <typename Handler>
+struct RecycledHandler {
+    using allocator_type = RecyclingAllocator<Handler>;
+    allocator_type get_allocator() const noexcept { return allocator_type(); }
+    template <typename... Args>
+    void operator()( Args&&... args )
+    {
+        handler( std::forward<Args>( args )... );
+    }
+    Handler handler;
+};
+
+template <typename Handler>
+RecycledHandler<typename std::decay<Handler>::type> recycled( Handler&& handler )
+{
+    return { std::forward<Handler>( handler ) };
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
+
+// Counter policy for the intrusive reference counts of sessions and
+// frames. The server touches both on its event loop thread only, so the
+// counts are plain integers; defining CHAT_ATOMIC_REFCOUNT (cmake
+// -DATOMIC_REFCOUNT=ON) makes them atomic for builds that run the event
+// loop on several threads.
+#ifdef CHAT_ATOMIC_REFCOUNT
+using RefCount = boost::thread_safe_counter;
+#else
+using RefCount = boost::thread_unsafe_counter;
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "Message.hpp"
+
+// Compact roster snapshot. Nicknames are sorted and every entry is
+//   varint id, varint shared prefix length, varint suffix length, suffix
+// where the prefix is shared with the previous nickname of the same
+// frame. Each frame restarts the prefix chain, so frames decode
+// independently and a large roster is just more frames in one write.
+struct Roster {
+    struct Entry {
+        uint32_t id;
+        std::string nickname;
+    };
+    // room for the protobuf framing of the roster field; the longest
+    // nickname still fits a frame of its own next to the varints of its
+    // entry (5 byte id, no prefix, 2 byte length)
+    enum {
+        MAX_ROSTER_SIZE = Message::MAX_BODY_SIZE - 16,
+        MAX_NICKNAME_SIZE = MAX_ROSTER_SIZE - 8,
+    };
+
+    static std::vector<Frame> encode( const std::map<std::string, uint32_t>& roster )
+    {
+        std::vector<Frame> result;
+        auto flush = [&result]( const std::string& blob ) {
+            RosterMessage message( blob );
+            if( message.serialized() ) {
+                result.push_back( message.frame() );
+            } else {
+                LL("roster: %d byte entry left out of the snapshot", blob.size());
+            }
+        };
+        std::string blob;
+        const std::string* previous = nullptr;
+        std::string entry;
+        for( auto& member: roster ) {
+            for( int attempt = 0; attempt < 2; ++attempt ) {
+                size_t prefix = 0;
+                if( previous ) {
+                    auto limit = std::min( previous->size(), member.first.size() );
+                    while( prefix < limit && ( *previous )[prefix] == member.first[prefix] ) {
+                        ++prefix;
+                    }
+                }
+                entry.clear();
+                put_varint( entry, member.second );
+                put_varint( entry, prefix );
+                put_varint( entry, member.first.size() - prefix );
+                entry.append( member.first, prefix, std::string::npos );
+                if( blob.size() + entry.size() <= MAX_ROSTER_SIZE || blob.empty() ) {
+                    break;
+                }
+                flush( blob );
+                blob.clear();
+                previous = nullptr;
+            }
+            blob += entry;
+            previous = &member.first;
+        }
+        if( blob.size() ) {
+            flush( blob );
+        }
+        return result;
+    }
+    static bool decode( const std::string& blob, std::vector<Entry>& entries )
+    {
+        std::string previous;
+        for( size_t position = 0; position < blob.size(); ) {
+            uint64_t id, prefix, suffix;
+            if( !get_varint( blob, position, id ) || !get_varint( blob, position, prefix )
+                || !get_varint( blob, position, suffix )
+                || prefix > previous.size() || suffix > blob.size() - position ) {
+                return false;
+            }
+            previous = previous.substr( 0, prefix ) + blob.substr( position, suffix );
+            position += suffix;
+            entries.push_back( { uint32_t( id ), previous } );
+        }
+        return true;
+    }
+    static void put_varint( std::string& out, uint64_t value )
+    {
+        while( value >= 0x80 ) {
+            out += char( value | 0x80 );
+            value >>= 7;
+        }
+        out += char( value );
+    }
+    static bool get_varint( const std::string& in, size_t& position, uint64_t& value )
+    {
+        value = 0;
+        for( int shift = 0; position < in.size() && shift < 64; shift += 7 ) {
+            uint8_t byte = in[position++];
+            value |= uint64_t( byte & 0x7f ) << shift;
+            if( !( byte & 0x80 ) ) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
@@ -0,0 +1,1861 @@
+#pragma once
+
+#include <deque>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <random>
+#include <cerrno>
+#include <sys/socket.h>
+#include "message.pb.h"
+#include <boost/asio.hpp>
+#include "Message.hpp"
+#include "History.hpp"
+#include "MessageLog.hpp"
+#include "Presence.hpp"
+#include "Roster.hpp"
+#include "TokenBucket.hpp"
+#include "Handoff.hpp"
+#include "ShmRing.hpp"
+#include "IoUring.hpp"
+#include "ReceivePool.hpp"
+#include "TimerWheel.hpp"
+#include "FrameQueue.hpp"
+#include "CompactString.hpp"
+#include "Recycler.hpp"
+#include "RefCount.hpp"
+#include "Log.hpp"
+
+using boost::asio::ip::tcp;
+// TCP or Unix domain stream socket of a session
+using Socket = boost::asio::generic::stream_protocol::socket;
+
+struct Config {
+    int port;
+    // links from other servers and relays, 0 for none
+    int peer_port = 0;
+    size_t history_count = 100;
+    size_t history_bytes = 64 * 1024;
+    unsigned inactivity_seconds = 10;
+    unsigned resume_seconds = 10;
+    size_t resume_frames = 256;
+    size_t reliable_window = 1024;
+    unsigned presence_milliseconds = 100;
+    double rate = 50;
+    double burst = 100;
+    std::string node;
+    std::vector<std::string> peers;
+    std::string handoff;
+    std::string unix_path;
+    std::string ring_path;
+    size_t ring_slots = 4096;
+    bool io_uring = false;
+    unsigned uring_entries = 4096;
+    unsigned drain_milliseconds = 5000;
+    size_t drain_batch = 500;
+    unsigned retry_milliseconds = 0;
+    size_t session_pool = 1024;
+    unsigned stats_seconds = 0;
+    MessageLog::Config log;
+};
+
+struct Server;
+struct Session;
+using SessionPtr = boost::intrusive_ptr<Session>;
+// The inactivity and resume timeouts of a session are one deadline on
+// the server's timer wheel, so an idle session owns no timer.
+struct Session : public boost::intrusive_ref_counter<Session, RefCount>, public TimerWheel<Session>::Entry {
+    Session( boost::asio::io_service& io_service, Socket socket, Server& server, const Config& config )
+        : io_service_( io_service ), socket_( std::move( socket ) ),
+          server_( server ), bucket_( config.rate, config.burst )
+    {}
+    // Sessions come from the Recycler, so a closed session's memory
+    // serves the next connection. The reference count is intrusive.
+    template <typename... Args>
+    static SessionPtr create( Args&&... args )
+    {
+        return SessionPtr( new Session( std::forward<Args>( args )... ) );
+    }
+    // warms the pool for count sessions
+    static void reserve( size_t count )
+    {
+        Recycler::local().reserve( sizeof( Session ), count );
+    }
+    SessionPtr ref() { return SessionPtr( this ); }
+    static void* operator new( size_t size ) { return Recycler::local().allocate( size ); }
+    static void operator delete( void* pointer, size_t size ) { Recycler::local().deallocate( pointer, size ); }
+    enum { MAX_WRITE_FRAMES = 64, CLOSE_SECONDS = 2 };
+    enum class Error {
+        NO_ERROR,
+        INACTIVITY,
+        DUPLICATE,
+    };
+    // control frames (presence, roster, session) overtake queued text
+    enum class Priority {
+        CONTROL,
+        TEXT,
+    };
+    static Priority priority( MessageBody::Type type )
+    {
+        return type == MessageBody::TEXT ? Priority::TEXT : Priority::CONTROL;
+    }
+
+    void run();
+    bool process_message( Message& message );
+
+    void send_message( const Message& message )
+    {
+        if( !message.serialized() ) {
+            LL("server: message is not serialized");
+            return;
+        }
+        send_frame( message.frame(), message.nickname(), priority( message.type() ) );
+    }
+    void send_frame( const Frame& frame, const std::string& sender, Priority priority )
+    {
+        LL("server: send message(%s -> %s)", sender.c_str(), nickname_.c_str());
+        if( nickname_.empty() || nickname_ == sender ) {
+            return;
+        }
+        enqueue( frame, priority );
+    }
+    void send_frames( const std::vector<Frame>& frames, Priority priority )
+    {
+        LL("server: sending %d frames to %s", frames.size(), nickname_.c_str());
+        if( nickname_.empty() ) {
+            return;
+        }
+        for( auto& frame: frames ) {
+            enqueue( frame, priority );
+        }
+    }
+    // Queues the notice ahead of everything else, drops queued text and
+    // closes once the notice is written. A client that does not read it
+    // is closed after CLOSE_SECONDS anyway.
+    void send_message_and_close( const Message& message, Error error )
+    {
+        LL("server: sending message and closing...");
+        error_ = error;
+        messages_to_send_.clear();
+        if( message.serialized() ) {
+            enqueue( message.frame(), Priority::CONTROL );
+        }
+        draining_ = true;
+        set_deadline( CLOSE_SECONDS );
+        close_when_flushed();
+    }
+    void start_inactivity_timer();
+    void restart_inactivity_timer();
+    void expire();
+    // server links carry frames of every user, so nothing is filtered
+    void send_to_peer( const Frame& frame, Priority priority )
+    {
+        enqueue( frame, priority );
+    }
+    void make_peer()
+    {
+        LL("server: session is a server link");
+        peer_ = true;
+        cancel_deadline();
+    }
+    bool peer() const { return peer_; }
+    // accepted on the peer port: it must introduce itself with PEER
+    void make_link() { link_ = true; }
+    bool detach();
+    Socket release_socket()
+    {
+        cancel_deadline();
+        return std::move( socket_ );
+    }
+    void adopt( Socket socket, uint64_t received );
+    void suspend();
+    void drain( const Frame& notice );
+    void close_when_flushed();
+    void save( SessionState& state ) const;
+    void restore( const SessionState& state );
+    Socket& socket() { return socket_; }
+    void close_socket();
+    bool detached() const { return detached_; }
+    void acknowledge( uint64_t ack );
+    std::string nickname() const { return nickname_.str(); }
+    std::string token() const { return token_.str(); }
+    const std::set<std::string>& rooms() const { return rooms_; }
+    Error error() const { return error_; }
+private:
+    boost::asio::io_service& io_service_;
+    // whole-buffer read and gather write, through io_uring if the server
+    // has one, else through asio; the session lives until the handler ran
+    using Buffers = std::vector<boost::asio::const_buffer, RecyclingAllocator<boost::asio::const_buffer> >;
+    template <typename Handler>
+    void read( char* data, size_t size, Handler handler );
+    template <typename Handler>
+    void write( Buffers buffers, Handler handler );
+    template <typename Handler>
+    void uring_read( char* data, size_t size, size_t done, Handler handler );
+    template <typename Handler>
+    void uring_write( IoUring::Buffers buffers, size_t done, Handler handler );
+    void set_deadline( unsigned seconds );
+    void cancel_deadline();
+    void wait_readable();
+    void receive_next();
+    void receive_message_header( size_t offset = 0 );
+    void receive_message_body( size_t offset = 0 );
+    void handle_message( bool parsed = false );
+    void enqueue( Frame frame, Priority priority );
+    void send_message();
+    void unwind_write( size_t written );
+    bool writing() const { return frames_in_flight_ || partial_; }
+    Socket socket_;
+    Server& server_;
+    // borrowed from the pool only while a frame is being read
+    ReceivePool::Buffer received_message_;
+    TokenBucket bucket_;
+    FrameQueue control_to_send_;
+    FrameQueue messages_to_send_;
+    // Frames taken for writing, oldest first; the last frames_in_flight_
+    // are being written, the rest are kept for replay after a resume
+    // (in reliable mode: until acknowledged).
+    FrameQueue messages_sent_;
+    size_t frames_in_flight_ = 0;
+    // newest frame of messages_sent_ when only its first partial_offset_
+    // bytes were written before a hot restart; the rest goes out first
+    Frame partial_;
+    size_t partial_offset_ = 0;
+    // hot restart: handlers record progress instead of going on
+    bool suspended_ = false;
+    size_t received_bytes_ = 0;
+    // graceful shutdown: nothing is queued after the notice
+    bool draining_ = false;
+    bool close_pending_ = false;
+    bool reliable_ = false;
+    // sequence number of the newest frame in messages_sent_; frames are
+    // numbered when taken for writing, so lanes may reorder them
+    uint64_t sequence_ = 0;
+    // bumped whenever the socket is replaced, stale handlers compare it
+    unsigned generation_ = 0;
+    bool detached_ = false;
+    bool peer_ = false;
+    bool link_ = false;
+    CompactString token_;
+    CompactString nickname_;
+    std::set<std::string> rooms_;
+    // wheel tick of the inactivity or resume timeout, 0 if none
+    uint64_t deadline_ = 0;
+    // created when the rate limit first holds the session back
+    std::unique_ptr<boost::asio::deadline_timer> throttle_timer_;
+    Error error_ = Error::NO_ERROR;
+};
+
+struct Server {
+    enum { MAX_QUERY_FRAMES = 256, PEER_RETRY_SECONDS = 5, SEEN_FRAMES = 65536, MAX_RING_FRAMES = 256, WHEEL_SLOTS = 64 };
+    Server( boost::asio::io_service& io_service, const Config& config )
+        : io_service_( io_service ), acceptor_( io_service ),
+          socket_( io_service ), unix_acceptor_( io_service ), unix_socket_( io_service ),
+          peer_acceptor_( io_service ), peer_socket_( io_service ),
+          config_( config ), history_( config.history_count, config.history_bytes ),
+          presence_timer_( io_service ), handoff_acceptor_( io_service ), handoff_socket_( io_service ),
+          signals_( io_service, SIGTERM ), drain_timer_( io_service ), stats_timer_( io_service ),
+          wheel_( io_service, boost::posix_time::seconds( 1 ), WHEEL_SLOTS, []( Session& session ) { session.expire(); } ),
+          ring_acceptor_( io_service ), ring_socket_( io_service ), ring_event_( io_service )
+    {
+        LL("server: started with port %d", config.port );
+        Session::reserve( config_.session_pool );
+        if( config_.io_uring ) {
+            uring_ = IoUring::create( io_service_, config_.uring_entries );
+            LL("server: using %s", uring_ ? "io_uring" : "the reactor");
+        }
+        if( config_.handoff.empty() || !take_over() ) {
+            tcp::endpoint endpoint( tcp::v4(), config.port );
+            acceptor_.open( endpoint.protocol() );
+            acceptor_.set_option( tcp::acceptor::reuse_address( true ) );
+            acceptor_.bind( endpoint );
+            acceptor_.listen();
+        }
+        if( config_.peer_port && !peer_acceptor_.is_open() ) {
+            tcp::endpoint endpoint( tcp::v4(), config_.peer_port );
+            peer_acceptor_.open( endpoint.protocol() );
+            peer_acceptor_.set_option( tcp::acceptor::reuse_address( true ) );
+            peer_acceptor_.bind( endpoint );
+            peer_acceptor_.listen();
+        }
+        if( !config_.unix_path.empty() && !unix_acceptor_.is_open() ) {
+            ::unlink( config_.unix_path.c_str() );
+            unix_acceptor_.open();
+            unix_acceptor_.bind( config_.unix_path );
+            unix_acceptor_.listen();
+        }
+        if( config_.node.empty() ) {
+            config_.node = make_token();
+        }
+        if( !config.log.directory.empty() ) {
+            message_log_ = std::make_unique<MessageLog>( config.log );
+        }
+        accept_connection();
+        if( unix_acceptor_.is_open() ) {
+            accept_unix_connection();
+        }
+        if( peer_acceptor_.is_open() ) {
+            accept_peer_connection();
+        }
+        if( !config_.ring_path.empty() ) {
+            ring_ = ShmRing::create( config_.ring_slots );
+            ring_event_.assign( ::dup( ring_->event() ) );
+            ::unlink( config_.ring_path.c_str() );
+            ring_acceptor_.open();
+            ring_acceptor_.bind( config_.ring_path );
+            ring_acceptor_.listen();
+            accept_ring_producer();
+            consume_ring();
+        }
+        for( auto& peer: config_.peers ) {
+            connect_peer( peer );
+        }
+        signals_.async_wait( [this]( const boost::system::error_code& ec, int ) {
+                if( !ec ) {
+                    drain();
+                }
+            } );
+        if( config_.stats_seconds ) {
+            log_allocations();
+        }
+        if( !config_.handoff.empty() ) {
+            ::unlink( config_.handoff.c_str() );
+            handoff_acceptor_.open();
+            handoff_acceptor_.bind( config_.handoff );
+            handoff_acceptor_.listen();
+            accept_handoff();
+        }
+    }
+    void accept_connection()
+    {
+        if( uring_ && !uring_accept_failed_ ) {
+            uring_->accept( acceptor_.native_handle(), [this]( int result, unsigned flags ) {
+                    if( stopped_accepting_ ) {
+                        if( result >= 0 ) {
+                            ::close( result );
+                        }
+                        return;
+                    }
+                    if( result >= 0 ) {
+                        LL("server: client connected");
+                        Socket socket( io_service_ );
+                        socket.assign( socket_protocol( result ), result );
+                        auto session = Session::create( io_service_, std::move( socket ), *this, config_ );
+                        session->run();
+                    } else if( result == -EINVAL ) {
+                        LL("server: no multishot accept, accepting through the reactor");
+                        uring_accept_failed_ = true;
+                    } else {
+                        LL("server: accept error: %s", strerror( -result ));
+                    }
+                    if( !IoUring::more( flags ) ) {
+                        accept_connection();
+                    }
+                } );
+            return;
+        }
+        LL("server: accept waiting for connection...");
+        acceptor_.async_accept( socket_, recycled( [this] (std::error_code ec) {
+                LL("server: client connected");
+                if( stopped_accepting_ ) {
+                    return;
+                }
+                if( !ec ) {
+                    auto session = Session::create( io_service_, std::move( socket_ ), *this, config_ );
+                    session->run();
+                }
+                accept_connection();
+            } ) );
+    }
+    // same-host clients, see --unix
+    void accept_unix_connection()
+    {
+        unix_acceptor_.async_accept( unix_socket_, recycled( [this] (std::error_code ec) {
+                LL("server: local client connected");
+                if( stopped_accepting_ ) {
+                    return;
+                }
+                if( !ec ) {
+                    auto session = Session::create( io_service_, std::move( unix_socket_ ), *this, config_ );
+                    session->run();
+                }
+                accept_unix_connection();
+            } ) );
+    }
+    // Other servers and relays link in on their own port, see --peer-port.
+    // Client connections are never promoted to links.
+    void accept_peer_connection()
+    {
+        peer_acceptor_.async_accept( peer_socket_, [this]( std::error_code ec ) {
+                if( stopped_accepting_ ) {
+                    return;
+                }
+                if( !ec ) {
+                    LL("server: server link connected");
+                    auto session = Session::create( io_service_, std::move( peer_socket_ ), *this, config_ );
+                    session->make_link();
+                    session->run();
+                }
+                accept_peer_connection();
+            } );
+    }
+    // Local producers get the shared-memory ring and its eventfd from the
+    // --ring socket and push TEXT frames into it, see ShmRing.
+    void accept_ring_producer()
+    {
+        ring_acceptor_.async_accept( ring_socket_, [this]( std::error_code ec ) {
+                if( ec ) {
+                    LL("server: ring accept error: %s", ec.message().c_str());
+                    return;
+                }
+                LL("server: ring producer attached");
+                ring_->share( ring_socket_.native_handle() );
+                ring_socket_.close();
+                accept_ring_producer();
+            } );
+    }
+    void consume_ring()
+    {
+        auto count = ring_->pop( MAX_RING_FRAMES, [this]( const char* frame, size_t size ) {
+                Message message;
+                memcpy( message.data(), frame, size );
+                if( size < Message::HEADER_SIZE || !message.get_header() || message.size() != size
+                    || !message.parse() || message.type() != MessageBody::TEXT ) {
+                    LL("server: bad frame in ring");
+                    return;
+                }
+                deliver( message );
+                relay( message );
+            } );
+        if( count == MAX_RING_FRAMES || !ring_->sleep() ) {
+            // more to come: yield to sockets first
+            boost::asio::post( io_service_, [this]() { consume_ring(); } );
+            return;
+        }
+        ring_event_.async_read_some( boost::asio::buffer( &ring_wakeups_, sizeof ring_wakeups_ ),
+            [this]( std::error_code ec, size_t ) {
+                if( !ec ) {
+                    consume_ring();
+                }
+            } );
+    }
+    void add( SessionPtr session )
+    {
+        LL("server: add session to server");
+        sessions_.insert( session );
+    }
+    void remove( SessionPtr session )
+    {
+        if( session->detach() ) {
+            LL("server: %s detached, waiting for resume", session->nickname().c_str());
+            return;
+        }
+        // closing the socket fails both the read and the write in flight
+        if( !sessions_.erase( session ) ) {
+            return;
+        }
+        auto error = session->error();
+        auto nickname = session->nickname();
+        LL("server: remove session from server");
+        if( draining_ ) {
+            // nobody is told about users leaving a server that goes away
+            if( sessions_.empty() ) {
+                LL("server: drained");
+                io_service_.stop();
+            }
+            return;
+        }
+        if( session->peer() ) {
+            remove_peer( session );
+            return;
+        }
+        auto it = nicknames_.find( nickname );
+        if( it != nicknames_.end() && it->second == session ) {
+            nicknames_.erase( it );
+        }
+        for( auto& room: session->rooms() ) {
+            leave( session, room );
+        }
+        switch( error ) {
+            case Session::Error::INACTIVITY:
+                if( !nickname.empty() ) {
+                    presence_changed( nickname, MessageBody::INACTIVITY );
+                    relay( RemoveInactivityMessage( nickname ) );
+                }
+                break;
+            case Session::Error::DUPLICATE:
+                ; // do nothing
+                break;
+            default:
+                if( !nickname.empty() && !remote_nicknames_.count( nickname ) ) {
+                    presence_changed( nickname, MessageBody::DISCONNECTED );
+                    relay( RemoveDisconnectedMessage( nickname ) );
+                }
+        }
+    }
+    // Joins and leaves are sent as one roster delta per presence window.
+    // The roster snapshot given to joining sessions is re-encoded once per
+    // window, together with the delta that brings older sessions up to date.
+    void presence_changed( const std::string& nickname, MessageBody::Type type )
+    {
+        if( type == MessageBody::ADD ) {
+            auto id = next_roster_id_++;
+            roster_[nickname] = id;
+            presence_.joined( nickname, id );
+        } else {
+            auto it = roster_.find( nickname );
+            if( it == roster_.end() ) {
+                return;
+            }
+            presence_.left( nickname, it->second, type );
+            roster_.erase( it );
+        }
+        if( presence_scheduled_ ) {
+            return;
+        }
+        presence_scheduled_ = true;
+        presence_timer_.expires_from_now( boost::posix_time::milliseconds( config_.presence_milliseconds ) );
+        presence_timer_.async_wait( [this]( const boost::system::error_code& ec ) {
+                if( !ec ) {
+                    flush_presence();
+                }
+            } );
+    }
+    // Blocks the frame and handler recyclers took from the system, from
+    // their free lists, and above their largest size class. Under a steady
+    // load the fresh counts stay flat.
+    void log_allocations()
+    {
+        stats_timer_.expires_from_now( boost::posix_time::seconds( config_.stats_seconds ) );
+        stats_timer_.async_wait( [this]( const boost::system::error_code& ec ) {
+                if( ec ) {
+                    return;
+                }
+                auto& frames = FramePool::stats();
+                auto& handlers = Recycler::local().stats();
+                LL("server: frames %llu fresh, %llu recycled, %llu large; handlers %llu fresh, %llu recycled, %llu large",
+                   (unsigned long long)frames.fresh, (unsigned long long)frames.recycled, (unsigned long long)frames.large,
+                   (unsigned long long)handlers.fresh, (unsigned long long)handlers.recycled, (unsigned long long)handlers.large);
+                log_allocations();
+            } );
+    }
+    void flush_presence()
+    {
+        presence_scheduled_ = false;
+        if( presence_.empty() ) {
+            return;
+        }
+        auto frames = presence_.frames();
+        LL("server: presence delta in %d frames", frames.size());
+        for( auto session: sessions_ ) {
+            session->send_frames( frames, Session::Priority::CONTROL );
+        }
+        roster_frames_ = Roster::encode( roster_ );
+        LL("server: roster of %d in %d frames", roster_.size(), roster_frames_.size());
+    }
+    void send_broadcast( const Message& message )
+    {
+        send_broadcast( message, message.frame() );
+    }
+    // one frame, built by the caller, for every recipient
+    void send_broadcast( const Message& message, const Frame& frame )
+    {
+        LL("server: send message broadcast");
+        auto nickname = message.nickname();
+        auto priority = Session::priority( message.type() );
+        for( auto session: sessions_ )
+            session->send_frame( frame, nickname, priority );
+    }
+    void send_room( const std::string& room, const Message& message )
+    {
+        LL("server: send message to room %s", room.c_str());
+        auto it = rooms_.find( room );
+        if( it == rooms_.end() ) {
+            return;
+        }
+        auto frame = message.frame();
+        auto nickname = message.nickname();
+        auto priority = Session::priority( message.type() );
+        for( auto session: it->second )
+            session->send_frame( frame, nickname, priority );
+    }
+    void send_direct( const std::string& recipient, const Message& message )
+    {
+        LL("server: send direct message to %s", recipient.c_str());
+        auto it = nicknames_.find( recipient );
+        if( it == nicknames_.end() ) {
+            LL("server: recipient %s not found", recipient.c_str());
+            return;
+        }
+        it->second->send_message( message );
+    }
+    // frame types a client may send; the rest only servers create
+    static bool client_frame( MessageBody::Type type )
+    {
+        switch( type ) {
+            case MessageBody::ADD:
+            case MessageBody::RESUME:
+            case MessageBody::TEXT:
+            case MessageBody::JOIN:
+            case MessageBody::LEAVE:
+            case MessageBody::HISTORY:
+            case MessageBody::ACK:
+                return true;
+            default:
+                return false;
+        }
+    }
+    void route( SessionPtr session, const Message& message )
+    {
+        if( !client_frame( message.type() ) ) {
+            LL("server: dropped frame of type %d from %s", message.type(), session->nickname().c_str());
+            return;
+        }
+        if( message.type() == MessageBody::HISTORY ) {
+            query_history( session, message );
+            return;
+        }
+        if( message.type() == MessageBody::ACK ) {
+            return;
+        }
+        if( message.type() == MessageBody::RESUME ) {
+            // resume failed and the session joined anew; don't leak the token
+            presence_changed( message.nickname(), MessageBody::ADD );
+            relay( AddMessage( message.nickname() ) );
+            return;
+        }
+        if( message.type() == MessageBody::TEXT && !message.room().empty() && message.recipient().empty()
+            && !session->rooms().count( message.room() ) ) {
+            LL("server: %s is not in room %s", session->nickname().c_str(), message.room().c_str());
+            return;
+        }
+        deliver( message );
+        relay( message );
+    }
+    // local delivery of a frame accepted here or relayed by a peer
+    void deliver( const Message& message )
+    {
+        if( message_log_ ) {
+            message_log_->append( message );
+        }
+        switch( message.type() ) {
+            case MessageBody::ADD:
+            case MessageBody::DISCONNECTED:
+            case MessageBody::INACTIVITY:
+                presence_changed( message.nickname(), message.type() );
+                break;
+            case MessageBody::JOIN:
+            case MessageBody::LEAVE:
+                send_room( message.room(), message );
+                break;
+            case MessageBody::TEXT:
+                if( !message.recipient().empty() ) {
+                    send_direct( message.recipient(), message );
+                } else if( message.room().empty() ) {
+                    auto frame = message.frame();
+                    history_.push( frame );
+                    send_broadcast( message, frame );
+                } else {
+                    send_room( message.room(), message );
+                }
+                break;
+            default:
+                send_broadcast( message );
+        }
+    }
+    // Server links. Every frame accepted from a local client is tagged
+    // with this node and a relay sequence number and sent to all peers.
+    // A peer delivers it locally and passes it on to its other peers;
+    // (origin, sequence) pairs already seen are dropped, so loops in the
+    // peer graph end after one extra hop.
+    void connect_peer( const std::string& address )
+    {
+        auto separator = address.rfind( ':' );
+        if( separator == std::string::npos ) {
+            LL("server: bad peer address %s", address.c_str());
+            return;
+        }
+        LL("server: connecting to peer %s", address.c_str());
+        auto resolver = std::make_shared<tcp::resolver>( io_service_ );
+        auto socket = std::make_shared<tcp::socket>( io_service_ );
+        resolver->async_resolve( address.substr( 0, separator ), address.substr( separator + 1 ),
+            [this, resolver, socket, address]( std::error_code ec, tcp::resolver::results_type endpoints ) {
+                if( ec ) {
+                    LL("server: cannot resolve peer %s: %s", address.c_str(), ec.message().c_str());
+                    retry_peer( address );
+                    return;
+                }
+                boost::asio::async_connect( *socket, endpoints,
+                    [this, socket, address]( std::error_code ec, const tcp::endpoint& ) {
+                        if( ec ) {
+                            LL("server: cannot connect to peer %s: %s", address.c_str(), ec.message().c_str());
+                            retry_peer( address );
+                            return;
+                        }
+                        auto session = Session::create( io_service_, std::move( *socket ), *this, config_ );
+                        session->make_peer();
+                        peers_[session] = Peer{ "", address };
+                        greet_peer( session );
+                        session->run();
+                    } );
+            } );
+    }
+    void retry_peer( const std::string& address )
+    {
+        auto timer = std::make_shared<boost::asio::deadline_timer>( io_service_,
+                                                                    boost::posix_time::seconds( int(PEER_RETRY_SECONDS) ) );
+        timer->async_wait( [this, timer, address]( const boost::system::error_code& ec ) {
+                if( !ec ) {
+                    connect_peer( address );
+                }
+            } );
+    }
+    // hello, then an ADD for every user this node knows of, so a node
+    // joining a star learns about the users behind the other links too
+    void greet_peer( SessionPtr session )
+    {
+        session->send_to_peer( PeerMessage( config_.node ).frame(), Session::Priority::CONTROL );
+        auto greet = [&]( const std::string& nickname ) {
+            AddMessage message( nickname );
+            if( message.set_origin( config_.node, ++relay_sequence_ ) ) {
+                session->send_to_peer( message.frame(), Session::Priority::CONTROL );
+            }
+        };
+        for( auto& local: nicknames_ ) {
+            greet( local.first );
+        }
+        for( auto& remote: remote_nicknames_ ) {
+            if( remote.second.link != session ) {
+                greet( remote.first );
+            }
+        }
+    }
+    void add_peer( SessionPtr session, const std::string& node )
+    {
+        LL("server: peer %s connected", node.c_str());
+        peers_[session] = Peer{ node, "" };
+        greet_peer( session );
+    }
+    void remove_peer( SessionPtr session )
+    {
+        auto it = peers_.find( session );
+        if( it == peers_.end() ) {
+            return;
+        }
+        auto peer = it->second;
+        peers_.erase( it );
+        LL("server: peer %s disconnected", peer.node.c_str());
+        // everyone reached through the link leaves, here and on the
+        // remaining links, which may only know them through this node
+        for( auto remote = remote_nicknames_.begin(); remote != remote_nicknames_.end(); ) {
+            if( remote->second.link == session ) {
+                auto nickname = remote->first;
+                remote = remote_nicknames_.erase( remote );
+                presence_changed( nickname, MessageBody::DISCONNECTED );
+                relay( RemoveDisconnectedMessage( nickname ) );
+            } else {
+                ++remote;
+            }
+        }
+        if( peer.address.size() ) {
+            retry_peer( peer.address );
+        }
+    }
+    void relay( const Message& message )
+    {
+        if( peers_.empty() ) {
+            return;
+        }
+        Message relayed = message;
+        if( !relayed.set_origin( config_.node, ++relay_sequence_ ) ) {
+            LL("server: message too big to relay");
+            return;
+        }
+        seen( config_.node, relay_sequence_ );
+        auto frame = relayed.frame();
+        auto priority = Session::priority( message.type() );
+        for( auto& peer: peers_ ) {
+            peer.first->send_to_peer( frame, priority );
+        }
+    }
+    // a frame that arrived on a server link
+    void route_remote( SessionPtr session, const Message& message )
+    {
+        if( message.type() == MessageBody::PEER ) {
+            peers_[session].node = message.origin();
+            return;
+        }
+        auto& body = message.message_body();
+        if( body.origin().empty() || !seen( body.origin(), body.origin_sequence() ) ) {
+            return;
+        }
+        auto frame = message.frame();
+        auto priority = Session::priority( message.type() );
+        for( auto& peer: peers_ ) {
+            if( peer.first != session ) {
+                peer.first->send_to_peer( frame, priority );
+            }
+        }
+        auto nickname = message.nickname();
+        auto origin = message.origin();
+        switch( message.type() ) {
+            case MessageBody::ADD: {
+                auto remote = remote_nicknames_.find( nickname );
+                if( remote != remote_nicknames_.end() ) {
+                    // the same nickname on two other nodes: the lower node id keeps it
+                    if( remote->second.origin <= origin ) {
+                        return;
+                    }
+                    remote->second = Remote{ origin, session };
+                    return;
+                }
+                auto local = nicknames_.find( nickname );
+                if( local != nicknames_.end() ) {
+                    if( config_.node < origin ) {
+                        LL("server: %s from %s rejected, local user wins", nickname.c_str(), origin.c_str());
+                        return;
+                    }
+                    LL("server: %s taken by %s, disconnecting local user", nickname.c_str(), origin.c_str());
+                    auto duplicate = local->second;
+                    nicknames_.erase( local );
+                    presence_changed( nickname, MessageBody::DISCONNECTED );
+                    duplicate->send_message_and_close( RemoveDuplicateMessage( nickname ), Session::Error::DUPLICATE );
+                }
+                remote_nicknames_[nickname] = Remote{ origin, session };
+                break;
+            }
+            case MessageBody::DISCONNECTED:
+            case MessageBody::INACTIVITY: {
+                // from the user's node, or from the node that announced the
+                // user and relays the leave when it loses its link to them
+                auto remote = remote_nicknames_.find( nickname );
+                if( remote == remote_nicknames_.end()
+                    || ( remote->second.origin != origin && remote->second.link != session ) ) {
+                    return;
+                }
+                remote_nicknames_.erase( remote );
+                break;
+            }
+            default:
+                break;
+        }
+        deliver( message );
+    }
+    // Records a relayed frame, false if it was seen before. Nodes are
+    // numbered as they first appear, so the key is two integers and the
+    // set takes its nodes from the recycler.
+    bool seen( const std::string& origin, uint64_t sequence )
+    {
+        auto node = node_indexes_.find( origin );
+        if( node == node_indexes_.end() ) {
+            node = node_indexes_.emplace( origin, uint32_t( node_indexes_.size() ) ).first;
+        }
+        Seen key{ node->second, sequence };
+        if( !seen_.insert( key ).second ) {
+            return false;
+        }
+        seen_order_.push_back( key );
+        if( seen_order_.size() > SEEN_FRAMES ) {
+            seen_.erase( seen_order_.front() );
+            seen_order_.pop_front();
+        }
+        return true;
+    }
+    // Reads the requested window from the message log on the history
+    // thread and hands the frames back to the session on the event loop.
+    // The session is moved, never copied, on the history thread: its
+    // reference count may only change on the event loop.
+    void query_history( SessionPtr session, const Message& message )
+    {
+        LL("server: history query from %s", session->nickname().c_str());
+        if( !message_log_ ) {
+            return;
+        }
+        auto since = message.since();
+        auto until = message.has_until() ? message.until() : std::numeric_limits<uint64_t>::max();
+        boost::asio::post( history_pool_,
+            [this, session, since, until, nickname = session->nickname(), rooms = session->rooms()]() mutable
+            {
+                auto frames = message_log_->read( since, until, MAX_QUERY_FRAMES,
+                    [&]( const char* frame, size_t size ) {
+                        MessageBody body;
+                        if( size < Message::HEADER_SIZE
+                            || !body.ParseFromArray( frame + Message::HEADER_SIZE, size - Message::HEADER_SIZE )
+                            || body.type() != MessageBody::TEXT ) {
+                            return false;
+                        }
+                        if( body.has_recipient() ) {
+                            return body.recipient() == nickname || body.nickname() == nickname;
+                        }
+                        return !body.has_room() || rooms.count( body.room() ) > 0;
+                    } );
+                LL("server: history query found %d frames", frames.size());
+                boost::asio::post( io_service_,
+                    [this, session = std::move( session ), frames = std::move( frames )]()
+                    {
+                        if( !sessions_.count( session ) ) {
+                            return;
+                        }
+                        std::vector<Frame> shared;
+                        shared.reserve( frames.size() );
+                        for( auto& frame: frames ) {
+                            shared.push_back( make_frame( frame.data(), frame.size() ) );
+                        }
+                        session->send_frames( shared, Session::Priority::TEXT );
+                    } );
+            } );
+    }
+    void join( SessionPtr session, const std::string& room )
+    {
+        LL("server: %s joins room %s", session->nickname().c_str(), room.c_str());
+        rooms_[room].insert( session );
+    }
+    void leave( SessionPtr session, const std::string& room )
+    {
+        LL("server: %s leaves room %s", session->nickname().c_str(), room.c_str());
+        auto it = rooms_.find( room );
+        if( it == rooms_.end() ) {
+            return;
+        }
+        it->second.erase( session );
+        if( it->second.empty() ) {
+            rooms_.erase( it );
+        }
+    }
+    bool validate_nickname( const std::string& nickname ) const
+    {
+        LL("server: validate nickname %s", nickname.c_str());
+        // a longer one could not be listed in a roster snapshot
+        return nickname.size() <= Roster::MAX_NICKNAME_SIZE
+            && !nicknames_.count( nickname ) && !remote_nicknames_.count( nickname );
+    }
+    void register_nickname( SessionPtr session )
+    {
+        LL("server: register nickname %s", session->nickname().c_str());
+        nicknames_[session->nickname()] = session;
+        session->send_frames( roster_frames_, Session::Priority::CONTROL );
+        session->send_frames( history_.frames(), Session::Priority::TEXT );
+    }
+    // Hands the socket of a fresh session over to the session it resumes.
+    bool resume( SessionPtr session, const Message& message )
+    {
+        auto it = nicknames_.find( message.nickname() );
+        if( it == nicknames_.end() || message.token().empty() || it->second->token() != message.token() ) {
+            LL("server: cannot resume %s", message.nickname().c_str());
+            return false;
+        }
+        LL("server: resume %s after frame %llu", message.nickname().c_str(), (unsigned long long)message.sequence());
+        sessions_.erase( session );
+        it->second->adopt( session->release_socket(), message.sequence() );
+        return true;
+    }
+    // Graceful shutdown on SIGTERM. Accepting stops, every session gets
+    // the rest of its queue followed by one SHUTDOWN notice, and sessions
+    // are closed drain_batch at a time spread over drain_milliseconds, so
+    // their clients do not all reconnect at the same moment. Sessions that
+    // have not flushed by then are closed anyway.
+    void drain()
+    {
+        LL("server: draining %d sessions", sessions_.size());
+        draining_ = true;
+        stopped_accepting_ = true;
+        boost::system::error_code ec;
+        if( uring_ ) {
+            uring_->cancel( acceptor_.native_handle() );
+        }
+        acceptor_.close( ec );
+        unix_acceptor_.close( ec );
+        peer_acceptor_.close( ec );
+        ring_acceptor_.close( ec );
+        handoff_acceptor_.close( ec );
+        presence_timer_.cancel();
+        stats_timer_.cancel();
+        flush_presence();
+        auto notice = ShutdownMessage( config_.retry_milliseconds ).frame();
+        for( auto& session: sessions_ ) {
+            if( session->peer() ) {
+                session->close_socket();
+            } else {
+                session->drain( notice );
+                drain_order_.push_back( session );
+            }
+        }
+        if( sessions_.empty() ) {
+            io_service_.stop();
+            return;
+        }
+        size_t batches = ( drain_order_.size() + config_.drain_batch - 1 ) / std::max<size_t>( config_.drain_batch, 1 );
+        drain_interval_ = boost::posix_time::milliseconds( config_.drain_milliseconds / std::max<size_t>( batches, 1 ) );
+        drain_batch();
+    }
+    void drain_batch()
+    {
+        if( drain_order_.empty() ) {
+            LL("server: drain deadline, closing %d sessions", sessions_.size());
+            io_service_.stop();
+            return;
+        }
+        auto count = std::min( drain_order_.size(), std::max<size_t>( config_.drain_batch, 1 ) );
+        LL("server: closing %d sessions", count);
+        std::vector<SessionPtr > batch( drain_order_.begin(), drain_order_.begin() + count );
+        drain_order_.erase( drain_order_.begin(), drain_order_.begin() + count );
+        for( auto& session: batch ) {
+            session->close_when_flushed();
+        }
+        drain_timer_.expires_from_now( drain_interval_ );
+        drain_timer_.async_wait( [this]( const boost::system::error_code& ec ) {
+                if( !ec ) {
+                    drain_batch();
+                }
+            } );
+    }
+    // Hot restart. A new process started with the same --handoff path
+    // connects to the running one, which stops accepting, suspends its
+    // sessions and passes the listening socket, every client socket and
+    // the session state over, then exits. Clients keep their connections.
+    void accept_handoff()
+    {
+        handoff_acceptor_.async_accept( handoff_socket_, [this]( std::error_code ec ) {
+                if( ec ) {
+                    LL("server: handoff accept error: %s", ec.message().c_str());
+                    return;
+                }
+                hand_over();
+            } );
+    }
+    void hand_over()
+    {
+        LL("server: handing over to a new process");
+        stopped_accepting_ = true;
+        boost::system::error_code ec;
+        if( uring_ ) {
+            uring_->cancel( acceptor_.native_handle() );
+        }
+        acceptor_.cancel( ec );
+        unix_acceptor_.cancel( ec );
+        peer_acceptor_.cancel( ec );
+        presence_timer_.cancel();
+        stats_timer_.cancel();
+        flush_presence();
+        for( auto& session: sessions_ ) {
+            if( session->peer() ) {
+                session->close_socket();
+            } else {
+                session->suspend();
+            }
+        }
+        if( uring_ ) {
+            uring_->run_completions();
+        }
+        // cancelled handlers run first and record where their I/O stopped
+        boost::asio::post( io_service_, [this]() { send_state(); } );
+    }
+    void send_state()
+    {
+        int fd = handoff_socket_.native_handle();
+        ServerState state;
+        state.set_node( config_.node );
+        state.set_relay_sequence( relay_sequence_ );
+        for( auto& member: roster_ ) {
+            state.add_roster_nicknames( member.first );
+            state.add_roster_ids( member.second );
+        }
+        state.set_next_roster_id( next_roster_id_ );
+        for( auto& frame: history_.frames() ) {
+            state.add_history( frame->data(), frame->size() );
+        }
+        state.set_local_listener( unix_acceptor_.is_open() );
+        state.set_peer_listener( peer_acceptor_.is_open() );
+        bool sent = Handoff::send( fd, state.SerializeAsString(), acceptor_.native_handle() );
+        if( sent && unix_acceptor_.is_open() ) {
+            sent = Handoff::send( fd, "local", unix_acceptor_.native_handle() );
+        }
+        if( sent && peer_acceptor_.is_open() ) {
+            sent = Handoff::send( fd, "peer", peer_acceptor_.native_handle() );
+        }
+        size_t count = 0;
+        for( auto& session: sessions_ ) {
+            if( !sent || session->peer() || session->error() != Session::Error::NO_ERROR ) {
+                continue;
+            }
+            SessionState session_state;
+            session->save( session_state );
+            sent = Handoff::send( fd, session_state.SerializeAsString(),
+                                  session->detached() ? -1 : session->socket().native_handle() );
+            ++count;
+        }
+        // the log is flushed and closed before the new process opens it
+        history_pool_.join();
+        message_log_.reset();
+        if( sent ) {
+            Handoff::send( fd, std::string() );
+        }
+        LL("server: handed over %d sessions%s", count, sent ? "" : ", failed");
+        io_service_.stop();
+    }
+    static boost::asio::generic::stream_protocol socket_protocol( int fd )
+    {
+        sockaddr_storage address;
+        socklen_t size = sizeof address;
+        if( ::getsockname( fd, reinterpret_cast<sockaddr*>( &address ), &size ) < 0 ) {
+            address.ss_family = AF_INET;
+        }
+        return boost::asio::generic::stream_protocol( address.ss_family,
+                                                     address.ss_family == AF_UNIX ? 0 : int(IPPROTO_TCP) );
+    }
+    bool take_over()
+    {
+        int fd = Handoff::connect( config_.handoff );
+        if( fd < 0 ) {
+            return false;
+        }
+        LL("server: taking over from the running process");
+        std::string payload;
+        int passed;
+        ServerState state;
+        if( !Handoff::receive( fd, payload, passed ) || passed < 0 || !state.ParseFromString( payload ) ) {
+            ::close( fd );
+            throw std::runtime_error( "hot restart handoff failed" );
+        }
+        acceptor_.assign( tcp::v4(), passed );
+        if( state.local_listener() ) {
+            if( !Handoff::receive( fd, payload, passed ) || passed < 0 ) {
+                ::close( fd );
+                throw std::runtime_error( "hot restart handoff failed" );
+            }
+            unix_acceptor_.assign( boost::asio::local::stream_protocol(), passed );
+        }
+        if( state.peer_listener() ) {
+            if( !Handoff::receive( fd, payload, passed ) || passed < 0 ) {
+                ::close( fd );
+                throw std::runtime_error( "hot restart handoff failed" );
+            }
+            peer_acceptor_.assign( tcp::v4(), passed );
+        }
+        if( config_.node.empty() ) {
+            config_.node = state.node();
+        }
+        relay_sequence_ = state.relay_sequence();
+        for( int i = 0; i < state.roster_nicknames_size() && i < state.roster_ids_size(); ++i ) {
+            roster_[state.roster_nicknames( i )] = state.roster_ids( i );
+        }
+        next_roster_id_ = state.next_roster_id();
+        roster_frames_ = Roster::encode( roster_ );
+        for( auto& frame: state.history() ) {
+            history_.push( make_frame( frame.data(), frame.size() ) );
+        }
+        std::vector<std::pair<SessionPtr, SessionState> > sessions;
+        while( Handoff::receive( fd, payload, passed ) && payload.size() ) {
+            SessionState session_state;
+            Socket socket( io_service_ );
+            if( passed >= 0 ) {
+                socket.assign( socket_protocol( passed ), passed );
+            }
+            if( !session_state.ParseFromString( payload ) ) {
+                continue;
+            }
+            auto session = Session::create( io_service_, std::move( socket ), *this, config_ );
+            sessions_.insert( session );
+            if( session_state.nickname().size() ) {
+                nicknames_[session_state.nickname()] = session;
+            }
+            for( auto& room: session_state.rooms() ) {
+                rooms_[room].insert( session );
+            }
+            sessions.emplace_back( session, std::move( session_state ) );
+        }
+        ::close( fd );
+        LL("server: took over %d sessions", sessions.size());
+        for( auto& session: sessions ) {
+            session.first->restore( session.second );
+        }
+        return true;
+    }
+    std::string make_token()
+    {
+        char token[17];
+        snprintf( token, sizeof token, "%016llx", (unsigned long long)random_() );
+        return token;
+    }
+    const Config& config() const { return config_; }
+    IoUring* uring() const { return uring_.get(); }
+    TimerWheel<Session>& wheel() { return wheel_; }
+
+private:
+    boost::asio::io_service& io_service_;
+    std::unique_ptr<IoUring> uring_;
+    bool uring_accept_failed_ = false;
+    tcp::acceptor acceptor_;
+    tcp::socket socket_;
+    boost::asio::local::stream_protocol::acceptor unix_acceptor_;
+    boost::asio::local::stream_protocol::socket unix_socket_;
+    tcp::acceptor peer_acceptor_;
+    tcp::socket peer_socket_;
+    Config config_;
+    std::mt19937_64 random_{ std::random_device{}() };
+    std::set<SessionPtr > sessions_;
+    std::map<std::string, std::set<SessionPtr > > rooms_;
+    std::unordered_map<std::string, SessionPtr > nicknames_;
+    struct Peer {
+        std::string node;
+        std::string address;    // empty for links the peer opened
+    };
+    std::map<SessionPtr, Peer> peers_;
+    // users connected to other nodes, with their node and the link they
+    // were announced on
+    struct Remote {
+        std::string origin;
+        SessionPtr link;
+    };
+    std::unordered_map<std::string, Remote> remote_nicknames_;
+    uint64_t relay_sequence_ = 0;
+    struct Seen {
+        uint32_t node;
+        uint64_t sequence;
+        bool operator==( const Seen& other ) const { return node == other.node && sequence == other.sequence; }
+    };
+    struct SeenHash {
+        size_t operator()( const Seen& seen ) const
+        {
+            return std::hash<uint64_t>()( seen.sequence ^ ( uint64_t( seen.node ) << 48 ) );
+        }
+    };
+    std::unordered_map<std::string, uint32_t> node_indexes_;
+    std::unordered_set<Seen, SeenHash, std::equal_to<Seen>, RecyclingAllocator<Seen> > seen_;
+    std::deque<Seen> seen_order_;
+    History history_;
+    Presence presence_;
+    std::map<std::string, uint32_t> roster_;
+    uint32_t next_roster_id_ = 0;
+    std::vector<Frame> roster_frames_;
+    boost::asio::deadline_timer presence_timer_;
+    bool presence_scheduled_ = false;
+    std::unique_ptr<MessageLog> message_log_;
+    boost::asio::thread_pool history_pool_{ 1 };
+    boost::asio::local::stream_protocol::acceptor handoff_acceptor_;
+    boost::asio::local::stream_protocol::socket handoff_socket_;
+    bool stopped_accepting_ = false;
+    boost::asio::signal_set signals_;
+    bool draining_ = false;
+    std::deque<SessionPtr > drain_order_;
+    boost::asio::deadline_timer drain_timer_;
+    boost::posix_time::time_duration drain_interval_;
+    boost::asio::deadline_timer stats_timer_;
+    TimerWheel<Session> wheel_;
+    std::unique_ptr<ShmRing> ring_;
+    boost::asio::local::stream_protocol::acceptor ring_acceptor_;
+    boost::asio::local::stream_protocol::socket ring_socket_;
+    boost::asio::posix::stream_descriptor ring_event_;
+    uint64_t ring_wakeups_;
+};
+
+inline void Session::set_deadline( unsigned seconds )
+{
+    deadline_ = server_.wheel().now() + seconds;
+    server_.wheel().schedule( *this, seconds );
+}
+inline void Session::cancel_deadline()
+{
+    deadline_ = 0;
+    server_.wheel().cancel( *this );
+}
+inline void Session::start_inactivity_timer()
+{
+    LL("server: inactivity timer started");
+    set_deadline( server_.config().inactivity_seconds );
+}
+// Only moves the deadline: the wheel finds out when the old one is due,
+// so a busy session costs no timer operation per message.
+inline void Session::restart_inactivity_timer()
+{
+    if( deadline_ && !peer_ && !detached_ && !close_pending_ ) {
+        deadline_ = server_.wheel().now() + server_.config().inactivity_seconds;
+    }
+}
+// Called by the wheel when the deadline may have passed: the client was
+// idle for too long, or a detached session was not resumed in time.
+inline void Session::expire()
+{
+    if( !deadline_ ) {
+        return;
+    }
+    auto now = server_.wheel().now();
+    if( now < deadline_ ) {
+        server_.wheel().schedule( *this, deadline_ - now );
+        return;
+    }
+    deadline_ = 0;
+    auto self = ref();
+    if( close_pending_ ) {
+        LL("server: %s did not take the closing notice", nickname_.c_str());
+        close_socket();
+        server_.remove( self );
+    } else if( detached_ ) {
+        LL("server: resume timer expired for %s", nickname_.c_str());
+        server_.remove( self );
+    } else {
+        LL("server: inactivity timer expired");
+        send_message_and_close( RemoveInactivityMessage( nickname_.str() ), Error::INACTIVITY );
+    }
+}
+inline void Session::run()
+{
+    LL("server: start session");
+    server_.add( ref() );
+    // server links are never idle, they stay until the connection drops
+    if( !peer_ ) {
+        start_inactivity_timer();
+    }
+    wait_readable();
+}
+// Gives the receive buffer back and borrows one again when data arrives.
+inline void Session::wait_readable()
+{
+    received_message_.reset();
+    auto readable = [this, generation = generation_]( bool ok ) {
+        if( generation != generation_ || suspended_ ) {
+            return;
+        }
+        if( !ok ) {
+            server_.remove( ref() );
+            return;
+        }
+        received_message_ = ReceivePool::local().take();
+        receive_message_header();
+    };
+    if( auto uring = server_.uring() ) {
+        uring->poll( socket_.native_handle(), [self = ref(), readable]( int result, unsigned ) {
+                readable( result > 0 );
+            } );
+    } else {
+        socket_.async_wait( Socket::wait_read, recycled( [self = ref(), readable]( const boost::system::error_code& ec ) {
+                readable( !ec );
+            } ) );
+    }
+}
+// Reads on with the same buffer only if the next frame is already queued:
+// the non-blocking receive of its header says would-block otherwise.
+inline void Session::receive_next()
+{
+    auto received = ::recv( socket_.native_handle(), received_message_->data(), Message::HEADER_SIZE, MSG_DONTWAIT );
+    if( received > 0 ) {
+        receive_message_header( received );
+    } else if( received < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ) {
+        wait_readable();
+    } else {
+        LL("server: receive header error: %s", received ? strerror( errno ) : "end of file");
+        server_.remove( ref() );
+    }
+}
+inline void Session::receive_message_header( size_t offset )
+{
+    LL("server: receiving message header...");
+    read( received_message_->data() + offset, Message::HEADER_SIZE - offset,
+                      [this, generation = generation_, offset]( std::error_code ec, size_t size )
+                      {
+                          LL("server: received message header");
+                          if( generation != generation_ ) {
+                              return;
+                          }
+                          if( suspended_ ) {
+                              received_bytes_ = offset + size;
+                              return;
+                          }
+                          if( !ec && received_message_->get_header() ) {
+                              restart_inactivity_timer();
+                              receive_message_body();
+                          } else {
+                              LL("server: receive header error: %s", ec.message().c_str());
+                              server_.remove( ref() );
+                          }
+                      }
+        );
+}
+inline void Session::receive_message_body( size_t offset )
+{
+    LL("server: receiving message body...");
+    read( received_message_->body() + offset, received_message_->body_size() - offset,
+                      [this, generation = generation_, offset]( std::error_code ec, size_t size )
+                      {
+                          LL("server: message received (%s,%d)", received_message_->data(), received_message_->size());
+                          if( generation != generation_ ) {
+                              return;
+                          }
+                          if( suspended_ ) {
+                              received_bytes_ = Message::HEADER_SIZE + offset + size;
+                              return;
+                          }
+                          if( !ec ) {
+                              restart_inactivity_timer();
+                              // acknowledgements are control frames and, as in the send
+                              // lanes, never wait behind text: a throttled ACK would stall
+                              // the client's own reliable window
+                              bool parsed = received_message_->parse();
+                              if( peer_ || ( parsed && received_message_->type() == MessageBody::ACK ) || bucket_.take() ) {
+                                  handle_message( parsed );
+                                  return;
+                              }
+                              // over the limit: keep the frame and stop reading until a token is due
+                              received_bytes_ = received_message_->size();
+                              auto delay = bucket_.delay();
+                              LL("server: %s throttled for %d us", nickname_.c_str(), int( delay.count() ));
+                              if( !throttle_timer_ ) {
+                                  throttle_timer_ = std::make_unique<boost::asio::deadline_timer>( io_service_ );
+                              }
+                              throttle_timer_->expires_from_now( boost::posix_time::microseconds( delay.count() ) );
+                              throttle_timer_->async_wait( recycled( [this, self = ref(), generation, parsed]( const boost::system::error_code& ec ) {
+                                      if( !ec && generation == generation_ ) {
+                                          bucket_.take();
+                                          handle_message( parsed );
+                                      }
+                                  } ) );
+                          } else {
+                              LL("server: receive body error: %s", ec.message().c_str());
+                              server_.remove( ref() );
+                          }
+                      }
+        );
+}
+// A frame read before a hot restart arrives here unparsed.
+inline void Session::handle_message( bool parsed )
+{
+    received_bytes_ = 0;
+    parsed = parsed || received_message_->parse();
+    if( peer_ ) {
+        if( parsed ) {
+            server_.route_remote( ref(), *received_message_ );
+        }
+        receive_next();
+    } else if( parsed && process_message( *received_message_ ) ) {
+        if( !peer_ ) {
+            server_.route( ref(), *received_message_ );
+        }
+        receive_next();
+    }
+}
+inline void Session::enqueue( Frame frame, Priority priority )
+{
+    if( draining_ ) {
+        return;
+    }
+    ( priority == Priority::CONTROL ? control_to_send_ : messages_to_send_ ).push_back( std::move( frame ) );
+    if( !writing() && !detached_ && !suspended_ ) {
+        send_message();
+    }
+}
+// Writes up to MAX_WRITE_FRAMES queued frames, control lane first, with
+// one gather write.
+inline void Session::send_message()
+{
+    LL("server: sending message message...");
+    size_t count = std::min<size_t>( control_to_send_.size() + messages_to_send_.size(), MAX_WRITE_FRAMES );
+    if( reliable_ ) {
+        auto window = server_.config().reliable_window;
+        count = std::min( count, window > messages_sent_.size() ? window - messages_sent_.size() : 0 );
+        if( !count && !partial_ ) {
+            LL("server: send window of %s is full", nickname_.c_str());
+            return;
+        }
+    }
+    Buffers buffers;
+    buffers.reserve( count + 1 );
+    if( partial_ ) {
+        buffers.push_back( boost::asio::buffer( partial_->data(), partial_->size() ) + partial_offset_ );
+    }
+    for( frames_in_flight_ = 0; frames_in_flight_ < count; ++frames_in_flight_ ) {
+        auto& lane = control_to_send_.size() ? control_to_send_ : messages_to_send_;
+        messages_sent_.push_back( std::move( lane.front() ) );
+        lane.pop_front();
+        buffers.push_back( boost::asio::buffer( messages_sent_.back()->data(), messages_sent_.back()->size() ) );
+    }
+    sequence_ += count;
+    write( std::move( buffers ),
+                       [this, generation = generation_]( std::error_code ec, size_t size )
+                       {
+                           LL("server: message sent");
+                           if( generation != generation_ ) {
+                               return;
+                           }
+                           if( suspended_ ) {
+                               unwind_write( ec ? size : std::numeric_limits<size_t>::max() );
+                               return;
+                           }
+                           frames_in_flight_ = 0;
+                           partial_.reset();
+                           if( !ec ) {
+                               auto resume_frames = server_.config().resume_frames;
+                               while( !reliable_ && messages_sent_.size() > resume_frames ) {
+                                   messages_sent_.pop_front();
+                               }
+                               if( control_to_send_.size() || messages_to_send_.size() ) {
+                                   send_message();
+                               } else if( close_pending_ ) {
+                                   close_when_flushed();
+                               }
+                           } else {
+                               LL("server: send error: %s", ec.message().c_str());
+                               server_.remove( ref() );
+                           }
+                       }
+        );
+}
+// Keeps a session that lost its connection registered for the resume
+// grace period; frames for it queue up meanwhile.
+inline bool Session::detach()
+{
+    auto resume_seconds = server_.config().resume_seconds;
+    if( error_ != Error::NO_ERROR || nickname_.empty() || detached_ || draining_ || !resume_seconds ) {
+        return false;
+    }
+    detached_ = true;
+    ++generation_;
+    frames_in_flight_ = 0;
+    partial_.reset();
+    received_message_.reset();
+    close_socket();
+    set_deadline( resume_seconds );
+    return true;
+}
+// Continues the session on a new connection, replaying every frame after
+// the last one the client received.
+inline void Session::adopt( Socket socket, uint64_t received )
+{
+    ++generation_;
+    close_socket();
+    socket_ = std::move( socket );
+    detached_ = false;
+    frames_in_flight_ = 0;
+    partial_.reset();
+    uint64_t first_sent = sequence_ - messages_sent_.size() + 1;
+    if( received + 1 < first_sent ) {
+        LL("server: %s missed %llu frames", nickname_.c_str(), (unsigned long long)( first_sent - received - 1 ));
+    }
+    // frames after the last received one go out again, ahead of everything
+    for( ; messages_sent_.size() && sequence_ > received; --sequence_ ) {
+        control_to_send_.push_front( std::move( messages_sent_.back() ) );
+        messages_sent_.pop_back();
+    }
+    messages_sent_.clear();
+    sequence_ = received;
+    LL("server: %s resumed, %d frames to send", nickname_.c_str(), control_to_send_.size() + messages_to_send_.size());
+    start_inactivity_timer();
+    wait_readable();
+    if( control_to_send_.size() || messages_to_send_.size() ) {
+        send_message();
+    }
+}
+// Stops all I/O for a hot restart. Pending handlers run with an error
+// and record how far their read or write got.
+inline void Session::suspend()
+{
+    suspended_ = true;
+    cancel_deadline();
+    if( throttle_timer_ ) {
+        throttle_timer_->cancel();
+    }
+    if( auto uring = server_.uring() ) {
+        uring->cancel( socket_.native_handle() );
+    }
+    boost::system::error_code ec;
+    socket_.cancel( ec );
+}
+// Queues the shutdown notice behind everything already queued.
+inline void Session::drain( const Frame& notice )
+{
+    if( !nickname_.empty() ) {
+        enqueue( notice, Priority::TEXT );
+    }
+    draining_ = true;
+    // a session already closing keeps the deadline that removes it
+    if( !close_pending_ ) {
+        cancel_deadline();
+    }
+}
+// A closed session may have no read or write left to fail, so it is
+// removed here rather than left to a timer.
+inline void Session::close_when_flushed()
+{
+    close_pending_ = true;
+    if( detached_ ) {
+        server_.remove( ref() );
+    } else if( !writing() && ( !socket_.is_open() || ( control_to_send_.empty() && messages_to_send_.empty() ) ) ) {
+        LL("server: closing %s", nickname_.c_str());
+        boost::system::error_code ec;
+        socket_.shutdown( Socket::shutdown_both, ec );
+        close_socket();
+        server_.remove( ref() );
+    }
+}
+// io_uring operations hold the socket open until they are cancelled
+inline void Session::close_socket()
+{
+    auto uring = server_.uring();
+    if( uring && socket_.is_open() ) {
+        uring->cancel( socket_.native_handle() );
+    }
+    boost::system::error_code ec;
+    socket_.close( ec );
+}
+inline std::error_code uring_error( int result )
+{
+    if( result == 0 ) {
+        return boost::system::error_code( boost::asio::error::eof );
+    }
+    if( result == -ECANCELED ) {
+        return boost::system::error_code( boost::asio::error::operation_aborted );
+    }
+    return std::error_code( -result, std::system_category() );
+}
+template <typename Handler>
+inline void Session::read( char* data, size_t size, Handler handler )
+{
+    if( server_.uring() ) {
+        uring_read( data, size, 0, std::move( handler ) );
+    } else {
+        boost::asio::async_read( socket_, boost::asio::buffer( data, size ), recycled(
+            [self = ref(), handler = std::move( handler )]( std::error_code ec, size_t size ) mutable {
+                handler( ec, size );
+            } ) );
+    }
+}
+template <typename Handler>
+inline void Session::write( Buffers buffers, Handler handler )
+{
+    if( server_.uring() ) {
+        IoUring::Buffers iov;
+        iov.reserve( buffers.size() );
+        for( auto& buffer: buffers ) {
+            iov.push_back( { const_cast<void*>( buffer.data() ), buffer.size() } );
+        }
+        uring_write( std::move( iov ), 0, std::move( handler ) );
+    } else {
+        boost::asio::async_write( socket_, buffers, recycled(
+            [self = ref(), handler = std::move( handler )]( std::error_code ec, size_t size ) mutable {
+                handler( ec, size );
+            } ) );
+    }
+}
+// receives until the buffer is full, like asio::async_read
+template <typename Handler>
+inline void Session::uring_read( char* data, size_t size, size_t done, Handler handler )
+{
+    if( done == size ) {
+        boost::asio::post( io_service_, recycled( [handler = std::move( handler ), size]() mutable { handler( std::error_code(), size ); } ) );
+        return;
+    }
+    server_.uring()->recv( socket_.native_handle(), data + done, size - done,
+        [this, self = ref(), data, size, done, handler = std::move( handler )]( int result, unsigned ) mutable {
+            if( result > 0 ) {
+                uring_read( data, size, done + result, std::move( handler ) );
+            } else {
+                handler( uring_error( result ), done );
+            }
+        } );
+}
+// sends until every buffer is out, like asio::async_write
+template <typename Handler>
+inline void Session::uring_write( IoUring::Buffers buffers, size_t done, Handler handler )
+{
+    if( buffers.empty() ) {
+        boost::asio::post( io_service_, recycled( [handler = std::move( handler ), done]() mutable { handler( std::error_code(), done ); } ) );
+        return;
+    }
+    server_.uring()->send( socket_.native_handle(), buffers,
+        [this, self = ref(), buffers, done, handler = std::move( handler )]( int result, unsigned ) mutable {
+            if( result <= 0 ) {
+                handler( uring_error( result ), done );
+                return;
+            }
+            size_t sent = result;
+            done += sent;
+            auto first = buffers.begin();
+            for( ; first != buffers.end() && sent >= first->iov_len; ++first ) {
+                sent -= first->iov_len;
+            }
+            buffers.erase( buffers.begin(), first );
+            if( buffers.size() ) {
+                buffers.front().iov_base = static_cast<char*>( buffers.front().iov_base ) + sent;
+                buffers.front().iov_len -= sent;
+            }
+            uring_write( std::move( buffers ), done, std::move( handler ) );
+        } );
+}
+// Puts frames of an interrupted write that did not reach the socket back
+// into the control lane; a frame cut in the middle becomes partial_.
+inline void Session::unwind_write( size_t written )
+{
+    if( partial_ ) {
+        auto rest = partial_->size() - partial_offset_;
+        if( written < rest ) {
+            partial_offset_ += written;
+            written = 0;
+        } else {
+            written -= rest;
+            partial_.reset();
+            partial_offset_ = 0;
+        }
+    }
+    auto first = messages_sent_.size() - frames_in_flight_;
+    for( ; first < messages_sent_.size() && written >= messages_sent_[first]->size(); ++first ) {
+        written -= messages_sent_[first]->size();
+    }
+    frames_in_flight_ = 0;
+    if( first == messages_sent_.size() ) {
+        return;
+    }
+    if( written ) {
+        partial_ = messages_sent_[first];
+        partial_offset_ = written;
+        ++first;
+    }
+    for( ; messages_sent_.size() > first; --sequence_ ) {
+        control_to_send_.push_front( std::move( messages_sent_.back() ) );
+        messages_sent_.pop_back();
+    }
+}
+inline void Session::save( SessionState& state ) const
+{
+    state.set_nickname( nickname_.str() );
+    state.set_token( token_.str() );
+    state.set_reliable( reliable_ );
+    state.set_detached( detached_ );
+    for( auto& room: rooms_ ) {
+        state.add_rooms( room );
+    }
+    state.set_sequence( sequence_ );
+    for( auto& frame: messages_sent_ ) {
+        state.add_sent( frame->data(), frame->size() );
+    }
+    for( auto& frame: control_to_send_ ) {
+        state.add_control( frame->data(), frame->size() );
+    }
+    for( auto& frame: messages_to_send_ ) {
+        state.add_text( frame->data(), frame->size() );
+    }
+    if( partial_ ) {
+        state.set_partial_offset( partial_offset_ );
+    }
+    if( received_message_ ) {
+        state.set_received( received_message_->data(), received_bytes_ );
+    }
+}
+// Continues a session handed over by the previous server process.
+inline void Session::restore( const SessionState& state )
+{
+    nickname_ = state.nickname();
+    token_ = state.token();
+    reliable_ = state.reliable();
+    rooms_.insert( state.rooms().begin(), state.rooms().end() );
+    sequence_ = state.sequence();
+    for( auto& frame: state.sent() ) {
+        messages_sent_.push_back( make_frame( frame.data(), frame.size() ) );
+    }
+    for( auto& frame: state.control() ) {
+        control_to_send_.push_back( make_frame( frame.data(), frame.size() ) );
+    }
+    for( auto& frame: state.text() ) {
+        messages_to_send_.push_back( make_frame( frame.data(), frame.size() ) );
+    }
+    if( state.partial_offset() && messages_sent_.size() ) {
+        partial_ = messages_sent_.back();
+        partial_offset_ = state.partial_offset();
+    }
+    if( state.detached() ) {
+        // the connection was lost before the restart, wait for a resume
+        if( !detach() ) {
+            server_.remove( ref() );
+        }
+        return;
+    }
+    auto& received = state.received();
+    if( received.size() > Message::HEADER_SIZE + Message::MAX_BODY_SIZE ) {
+        server_.remove( ref() );
+        return;
+    }
+    start_inactivity_timer();
+    if( received.size() ) {
+        received_message_ = ReceivePool::local().take();
+        memcpy( received_message_->data(), received.data(), received.size() );
+    }
+    if( received.empty() ) {
+        wait_readable();
+    } else if( received.size() < Message::HEADER_SIZE ) {
+        receive_message_header( received.size() );
+    } else if( !received_message_->get_header() ) {
+        server_.remove( ref() );
+        return;
+    } else if( received.size() < received_message_->size() ) {
+        receive_message_body( received.size() - Message::HEADER_SIZE );
+    } else {
+        boost::asio::post( io_service_, [this, self = ref()]() { handle_message(); } );
+    }
+    if( partial_ || control_to_send_.size() || messages_to_send_.size() ) {
+        send_message();
+    }
+}
+// drops written frames up to and including the acknowledged one
+inline void Session::acknowledge( uint64_t ack )
+{
+    uint64_t first_sent = sequence_ - messages_sent_.size() + 1;
+    for( ; messages_sent_.size() > frames_in_flight_ && first_sent <= ack; ++first_sent ) {
+        messages_sent_.pop_front();
+    }
+    if( !writing() && !detached_ && !suspended_ && ( control_to_send_.size() || messages_to_send_.size() ) ) {
+        send_message();
+    }
+}
+inline bool Session::process_message( Message& message )
+{
+    LL("server: process message");
+    if( reliable_ && message.has_ack() ) {
+        acknowledge( message.ack() );
+    }
+    if( link_ ) {
+        if( message.type() != MessageBody::PEER ) {
+            LL("server: link did not introduce itself, closing");
+            server_.remove( ref() );
+            close_socket();
+            return false;
+        }
+        link_ = false;
+        make_peer();
+        server_.add_peer( ref(), message.origin() );
+        return true;
+    }
+    if( ( message.type() == MessageBody::ADD || message.type() == MessageBody::RESUME ) && !nickname_.empty() ) {
+        // a session keeps the nickname it logged in with
+        LL("server: %s logged in again, frame dropped", nickname_.c_str());
+        receive_next();
+        return false;
+    }
+    if( message.type() == MessageBody::RESUME && nickname_.empty() ) {
+        auto self = ref();
+        if( server_.resume( self, message ) ) {
+            return false;
+        }
+    }
+    if( message.type() == MessageBody::ADD || message.type() == MessageBody::RESUME ) {
+        if( !server_.validate_nickname( message.nickname() ) ) {
+            LL("server: nickname %s already exists or is too long", message.nickname().c_str());
+            send_message_and_close( RemoveDuplicateMessage( message.nickname() ), Error::DUPLICATE );
+            return false;
+        } else {
+            nickname_ = message.nickname();
+            reliable_ = message.reliable();
+            token_ = server_.make_token();
+            enqueue( SessionMessage( nickname_.str(), token_.str(), sequence_ + control_to_send_.size() + 1 ).frame(), Priority::CONTROL );
+            server_.register_nickname( ref() );
+            LL("server: nickname %s added", nickname_.c_str());
+        }
+    }
+    if( message.type() == MessageBody::JOIN && !nickname_.empty() && !message.room().empty() ) {
+        rooms_.insert( message.room() );
+        server_.join( ref(), message.room() );
+    } else if( message.type() == MessageBody::LEAVE ) {
+        rooms_.erase( message.room() );
+        server_.leave( ref(), message.room() );
+    }
+    return true;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Message.hpp"
+#include "Handoff.hpp"
+#include "Log.hpp"
+
+// Shared-memory ring of wire-ready frames from local producers to the
+// server (many producers, one consumer). The slot array is a bounded
+// MPMC-style queue: every slot carries a sequence number telling whose
+// turn it is, so producers claim slots with one CAS on head and publish
+// them with one store, without locks or syscalls. The consumer sleeps
+// on an eventfd; a producer writes it only if the consumer said it is
+// about to sleep, so a busy ring costs no syscalls per frame.
+//
+// The server creates the ring (memfd) and the eventfd and hands both to
+// producers that connect to its --ring socket, as Handoff records.
+struct ShmRing {
+    enum { SLOT_SIZE = Message::HEADER_SIZE + Message::MAX_BODY_SIZE };
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        uint32_t size;
+        char frame[SLOT_SIZE];
+    };
+    struct Header {
+        uint64_t capacity;              // slots, a power of two
+        alignas( 64 ) std::atomic<uint64_t> head;
+        alignas( 64 ) std::atomic<uint64_t> tail;
+        alignas( 64 ) std::atomic<uint32_t> sleeping;
+    };
+
+    ShmRing( const ShmRing& ) = delete;
+    ShmRing& operator=( const ShmRing& ) = delete;
+    ~ShmRing()
+    {
+        if( header_ ) {
+            ::munmap( header_, mapping_size( capacity_ ) );
+        }
+        if( memory_ >= 0 ) {
+            ::close( memory_ );
+        }
+        if( event_ >= 0 ) {
+            ::close( event_ );
+        }
+    }
+    // server side
+    static std::unique_ptr<ShmRing> create( size_t slots )
+    {
+        size_t capacity = 1;
+        while( capacity < slots ) {
+            capacity <<= 1;
+        }
+        std::unique_ptr<ShmRing> ring( new ShmRing );
+        ring->memory_ = ::memfd_create( "chat-ring", MFD_CLOEXEC );
+        ring->event_ = ::eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        if( ring->memory_ < 0 || ring->event_ < 0 || ::ftruncate( ring->memory_, mapping_size( capacity ) ) < 0 ) {
+            throw std::runtime_error( "cannot create shared memory ring" );
+        }
+        ring->map( capacity );
+        auto header = ring->header_;
+        header->capacity = capacity;
+        header->head = 0;
+        header->tail = 0;
+        header->sleeping = 0;
+        for( size_t i = 0; i < capacity; ++i ) {
+            ring->slots_[i].sequence.store( i, std::memory_order_relaxed );
+        }
+        return ring;
+    }
+    // producer side: connects to the server's ring socket
+    static std::unique_ptr<ShmRing> attach( const std::string& path )
+    {
+        int socket = Handoff::connect( path );
+        if( socket < 0 ) {
+            throw std::runtime_error( "cannot connect to ring socket " + path );
+        }
+        std::unique_ptr<ShmRing> ring( new ShmRing );
+        std::string payload;
+        bool received = Handoff::receive( socket, payload, ring->memory_ ) && payload == "ring"
+            && Handoff::receive( socket, payload, ring->event_ ) && payload == "event";
+        ::close( socket );
+        if( !received || ring->memory_ < 0 || ring->event_ < 0 ) {
+            throw std::runtime_error( "cannot attach to shared memory ring" );
+        }
+        // from the size of the memory, not the header another producer may
+        // have overwritten
+        struct stat status;
+        if( ::fstat( ring->memory_, &status ) < 0 || size_t( status.st_size ) < mapping_size( 1 ) ) {
+            throw std::runtime_error( "cannot read shared memory ring" );
+        }
+        uint64_t capacity = ( status.st_size - sizeof( Header ) ) / sizeof( Slot );
+        if( capacity & ( capacity - 1 ) ) {
+            throw std::runtime_error( "cannot read shared memory ring" );
+        }
+        ring->map( capacity );
+        return ring;
+    }
+    // gives a connected producer the ring and the eventfd
+    bool share( int socket ) const
+    {
+        return Handoff::send( socket, "ring", memory_ ) && Handoff::send( socket, "event", event_ );
+    }
+    // Copies a frame into the ring; false if the ring is full or the
+    // frame is too big. Never blocks.
+    bool push( const char* frame, size_t size )
+    {
+        if( size > SLOT_SIZE ) {
+            return false;
+        }
+        auto position = header_->head.load( std::memory_order_relaxed );
+        Slot* slot;
+        for( ;; ) {
+            slot = &slots_[position & mask_];
+            auto sequence = slot->sequence.load( std::memory_order_acquire );
+            if( sequence == position ) {
+                if( header_->head.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ) {
+                    break;
+                }
+            } else if( sequence < position ) {
+                return false;
+            } else {
+                position = header_->head.load( std::memory_order_relaxed );
+            }
+        }
+        slot->size = size;
+        memcpy( slot->frame, frame, size );
+        slot->sequence.store( position + 1, std::memory_order_release );
+        // pairs with the store in sleep(): either the consumer sees the
+        // frame or this sees it sleeping
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        if( header_->sleeping.load( std::memory_order_relaxed ) && header_->sleeping.exchange( 0 ) ) {
+            uint64_t one = 1;
+            if( ::write( event_, &one, sizeof one ) < 0 ) {
+                LL("ring: wakeup error");
+            }
+        }
+        return true;
+    }
+    bool push( const Message& message )
+    {
+        return message.serialized() && push( message.data(), message.size() );
+    }
+    // Consumer: passes up to limit frames to the callback, returns the
+    // number taken.
+    template <typename Callback>
+    size_t pop( size_t limit, Callback callback )
+    {
+        size_t count = 0;
+        auto position = header_->tail.load( std::memory_order_relaxed );
+        for( ; count < limit; ++count, ++position ) {
+            auto& slot = slots_[position & mask_];
+            if( slot.sequence.load( std::memory_order_acquire ) != position + 1 ) {
+                break;
+            }
+            callback( slot.frame, std::min<size_t>( slot.size, SLOT_SIZE ) );
+            slot.sequence.store( position + capacity_, std::memory_order_release );
+        }
+        header_->tail.store( position, std::memory_order_relaxed );
+        return count;
+    }
+    // Consumer: announces it is going to wait on the eventfd; false if
+    // a frame arrived meanwhile and it should not wait.
+    bool sleep()
+    {
+        header_->sleeping.store( 1, std::memory_order_seq_cst );
+        auto position = header_->tail.load( std::memory_order_relaxed );
+        auto& slot = slots_[position & mask_];
+        if( slot.sequence.load( std::memory_order_acquire ) == position + 1 ) {
+            header_->sleeping.store( 0 );
+            return false;
+        }
+        return true;
+    }
+    int event() const { return event_; }
+private:
+    ShmRing() = default;
+    static size_t mapping_size( size_t capacity )
+    {
+        return sizeof( Header ) + capacity * sizeof( Slot );
+    }
+    void map( size_t capacity )
+    {
+        void* mapping = ::mmap( nullptr, mapping_size( capacity ), PROT_READ | PROT_WRITE, MAP_SHARED, memory_, 0 );
+        if( mapping == MAP_FAILED ) {
+            throw std::runtime_error( "cannot map shared memory ring" );
+        }
+        header_ = static_cast<Header*>( mapping );
+        slots_ = reinterpret_cast<Slot*>( static_cast<char*>( mapping ) + sizeof( Header ) );
+        capacity_ = capacity;
+        mask_ = capacity - 1;
+    }
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+    // kept here: producers can write anything into the shared header
+    uint64_t capacity_ = 0;
+    uint64_t mask_ = 0;
+    int memory_ = -1;
+    int event_ = -1;
+};
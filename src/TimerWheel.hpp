@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/intrusive/list.hpp>
+#include "Recycler.hpp"
+
+// Coarse timeouts for many objects on one asio timer. An object derives
+// from TimerWheel<T>::Entry, a two-pointer hook that links it into the
+// slot of the tick it is due at. Rescheduling relinks it and destroying
+// it unlinks it, so the wheel holds no references and allocates nothing
+// per entry. Timeouts longer than the wheel are checked once per turn
+// and rescheduled by the expire callback.
+template <typename T>
+struct TimerWheel {
+    using Entry = boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink> >;
+    using Expire = std::function<void( T& )>;
+
+    TimerWheel( boost::asio::io_service& io_service, boost::posix_time::time_duration tick, size_t slots, Expire expire )
+        : timer_( io_service ), tick_( tick ), slots_( std::max<size_t>( slots, 2 ) ), expire_( std::move( expire ) )
+    {
+        timer_.expires_from_now( tick_ );
+        wait();
+    }
+    TimerWheel( const TimerWheel& ) = delete;
+    TimerWheel& operator=( const TimerWheel& ) = delete;
+    ~TimerWheel()
+    {
+        for( auto& slot: slots_ ) {
+            slot.clear();
+        }
+    }
+    // ticks elapsed since the wheel started
+    uint64_t now() const { return now_; }
+    // expires the entry no earlier than `ticks` ticks from now, or at the
+    // end of the turn if that is further away
+    void schedule( T& entry, uint64_t ticks )
+    {
+        entry.Entry::unlink();
+        ticks = std::min<uint64_t>( ticks + 1, slots_.size() - 1 );
+        slots_[( now_ + ticks ) % slots_.size()].push_back( entry );
+    }
+    void cancel( T& entry )
+    {
+        entry.Entry::unlink();
+    }
+    static bool scheduled( const T& entry )
+    {
+        return entry.Entry::is_linked();
+    }
+    void stop()
+    {
+        timer_.cancel();
+    }
+private:
+    using Slot = boost::intrusive::list<T, boost::intrusive::base_hook<Entry>, boost::intrusive::constant_time_size<false> >;
+    void wait()
+    {
+        timer_.async_wait( recycled( [this]( const boost::system::error_code& ec ) {
+                if( ec ) {
+                    return;
+                }
+                tick();
+                // keeps to the original schedule however long tick() took
+                timer_.expires_at( timer_.expires_at() + tick_ );
+                wait();
+            } ) );
+    }
+    void tick()
+    {
+        ++now_;
+        Slot due;
+        due.swap( slots_[now_ % slots_.size()] );
+        // an expiring entry may destroy others, which unlink themselves
+        while( !due.empty() ) {
+            auto& entry = due.front();
+            due.pop_front();
+            expire_( entry );
+        }
+    }
+    boost::asio::deadline_timer timer_;
+    boost::posix_time::time_duration tick_;
+    std::vector<Slot> slots_;
+    Expire expire_;
+    uint64_t now_ = 0;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+// Token bucket: up to `burst` messages at once, refilled at `rate`
+// messages per second. A zero rate disables the limit.
+struct TokenBucket {
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket( double rate, double burst )
+        : rate_( rate ), burst_( std::max( burst, 1.0 ) ), tokens_( burst_ ), last_( Clock::now() )
+    {}
+    bool take()
+    {
+        if( !rate_ ) {
+            return true;
+        }
+        refill();
+        if( tokens_ < 1 ) {
+            return false;
+        }
+        tokens_ -= 1;
+        return true;
+    }
+    // time until the next token is available
+    std::chrono::microseconds delay()
+    {
+        refill();
+        if( !rate_ || tokens_ >= 1 ) {
+            return std::chrono::microseconds( 0 );
+        }
+        return std::chrono::microseconds( int64_t( ( 1 - tokens_ ) / rate_ * 1e6 ) + 1 );
+    }
+private:
+    void refill()
+    {
+        auto now = Clock::now();
+        tokens_ = std::min( burst_, tokens_ + std::chrono::duration<double>( now - last_ ).count() * rate_ );
+        last_ = now;
+    }
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_;
+};
@@ -1,9 +1,14 @@
 #include <cstdlib>
 #include <iostream>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <unordered_map>
 #include "message.pb.h"
 #include "CLI11.hpp"
 #include <boost/asio.hpp>
 #include "Message.hpp"
+#include "Roster.hpp"
 #include "Log.hpp"
 
 //#if !defined(ASIO_HAS_POSIX_STREAM_DESCRIPTOR)
@@ -14,30 +19,33 @@ using boost::asio::ip::tcp;
 
 struct Client {
     Client( boost::asio::io_service& io_service, const std::string& address,
-            const std::string& port, const std::string& nickname )
-        : io_service_( io_service ), socket_( io_service ), nickname_( nickname ),
+            const std::string& port, const std::string& unix_path, const std::string& nickname, bool reliable )
+        : io_service_( io_service ), socket_( io_service ), address_( address ), port_( port ), unix_path_( unix_path ),
+          resolver_( io_service ), nickname_( nickname ), reliable_( reliable ),
           input_( io_service, ::dup( STDIN_FILENO ) ),
           output_( io_service, ::dup( STDOUT_FILENO ) ),
           input_buffer_( Message::MAX_BODY_SIZE ),
           connection_timer_( io_service ),
-          retry_timer_( io_service )
+          retry_timer_( io_service ),
+          attempt_timer_( io_service ),
+          ack_timer_( io_service )
     {
-        tcp::resolver resolver( io_service );
-        endpoint_iterator_ = resolver.resolve( { address, port } );
         connect();
     }
 private:
-    enum { CONNECTION_SECONDS = 3, RETRY_SECONDS = 5 };
+    enum { CONNECTION_SECONDS = 3, RETRY_MILLISECONDS = 500, MAX_RETRY_MILLISECONDS = 30000,
+           ATTEMPT_MILLISECONDS = 250, ACK_FRAMES = 32, ACK_MILLISECONDS = 200 };
     void start_connection_timer()
     {
         LL("%s: start connection timer", nickname_.c_str());
         connection_timer_.expires_from_now( boost::posix_time::seconds( int(CONNECTION_SECONDS) ) );
-        connection_timer_.async_wait( [this]( const boost::system::error_code& ) {
-                if( connection_timer_.expires_at() <= boost::asio::deadline_timer::traits_type::now() )
+        connection_timer_.async_wait( [this, generation = connect_generation_]( const boost::system::error_code& ) {
+                if( generation == connect_generation_
+                    && connection_timer_.expires_at() <= boost::asio::deadline_timer::traits_type::now() )
                 {
                     LL("%s: connection timer expired", nickname_.c_str());
-                    socket_.close();
                     connection_timer_.expires_at( boost::posix_time::pos_infin );
+                    connect_failed();
                 }
             } );
     }
@@ -46,11 +54,18 @@ private:
         LL("%s: stop connection timer", nickname_.c_str());
         connection_timer_.expires_at( boost::posix_time::pos_infin );
     }
+    // Capped exponential backoff with full jitter, so clients dropped
+    // together do not come back together; never sooner than the server
+    // asked for in its SHUTDOWN notice.
     void reconnect()
     {
         LL("%s: reconnecting...", nickname_.c_str());
-        retry_timer_.expires_from_now( boost::posix_time::seconds( int(RETRY_SECONDS) ) );
-        LL("%s: waiting for %d seconds...", nickname_.c_str(), RETRY_SECONDS);
+        uint64_t ceiling = std::min<uint64_t>( MAX_RETRY_MILLISECONDS, uint64_t( RETRY_MILLISECONDS ) << std::min( retries_, 16u ) );
+        auto delay = retry_after_ + std::uniform_int_distribution<uint64_t>( 0, ceiling )( random_ );
+        ++retries_;
+        retry_after_ = 0;
+        retry_timer_.expires_from_now( boost::posix_time::milliseconds( delay ) );
+        LL("%s: waiting for %llu milliseconds...", nickname_.c_str(), (unsigned long long)delay);
         retry_timer_.async_wait( [this]( const boost::system::error_code& ec ) {
                 if( retry_timer_.expires_at() <= boost::asio::deadline_timer::traits_type::now() )
                 {
@@ -64,42 +79,149 @@ private:
         LL("%s: stop retry timer", nickname_.c_str());
         retry_timer_.expires_at( boost::posix_time::pos_infin );
     }
+    // Resolves the server address anew on every connect and races
+    // connections to all its addresses, happy eyeballs style: address
+    // families alternate, a new attempt starts every ATTEMPT_MILLISECONDS
+    // or as soon as the previous one fails, and the first to connect wins.
     void connect()
     {
         LL("%s: connecting...", nickname_.c_str());
         stop_retry_timer();
+        ++connect_generation_;
         start_connection_timer();
-        boost::asio::async_connect( socket_, endpoint_iterator_,
-                             [this]( std::error_code ec, tcp::resolver::iterator )
-                             {
-                                 stop_connection_timer();
-                                 LL("%s: handle connect", nickname_.c_str());
-                                 if( !socket_.is_open() )
-                                 {
-                                     LL("%s: connect timout", nickname_.c_str());
-                                     reconnect();
-                                 }
-                                 else if( ec ) {
-                                     LL("%s: connect error: %s", nickname_.c_str(), ec.message().c_str());
-                                     socket_.close();
-                                     reconnect();
-                                 } else {
-                                     LL("%s: connected", nickname_.c_str());
-                                     auto message = AddMessage( nickname_ );
-                                     send_message( message );
-                                     receive_input();
-                                     receive_message_header();
-                                 }
-                             }
-            );
+        if( !unix_path_.empty() ) {
+            auto socket = std::make_shared<boost::asio::local::stream_protocol::socket>( io_service_ );
+            socket->async_connect( boost::asio::local::stream_protocol::endpoint( unix_path_ ),
+                [this, socket, generation = connect_generation_]( std::error_code ec ) {
+                    if( generation != connect_generation_ ) {
+                        return;
+                    }
+                    if( ec ) {
+                        LL("%s: connect error: %s", nickname_.c_str(), ec.message().c_str());
+                        connect_failed();
+                        return;
+                    }
+                    socket_ = std::move( *socket );
+                    stop_connection_timer();
+                    connected();
+                } );
+            return;
+        }
+        resolver_.async_resolve( address_, port_,
+            [this, generation = connect_generation_]( std::error_code ec, tcp::resolver::results_type results ) {
+                if( generation != connect_generation_ ) {
+                    return;
+                }
+                if( ec ) {
+                    LL("%s: resolve error: %s", nickname_.c_str(), ec.message().c_str());
+                    connect_failed();
+                    return;
+                }
+                std::deque<tcp::endpoint> v4, v6;
+                for( auto& result: results ) {
+                    ( result.endpoint().address().is_v6() ? v6 : v4 ).push_back( result.endpoint() );
+                }
+                auto& first = results.begin()->endpoint().address().is_v6() ? v6 : v4;
+                auto& second = &first == &v6 ? v4 : v6;
+                endpoints_.clear();
+                while( first.size() || second.size() ) {
+                    for( auto family: { &first, &second } ) {
+                        if( family->size() ) {
+                            endpoints_.push_back( family->front() );
+                            family->pop_front();
+                        }
+                    }
+                }
+                next_endpoint_ = 0;
+                pending_attempts_ = 0;
+                start_attempt();
+            } );
+    }
+    void start_attempt()
+    {
+        if( next_endpoint_ >= endpoints_.size() ) {
+            return;
+        }
+        auto endpoint = endpoints_[next_endpoint_++];
+        auto socket = std::make_shared<tcp::socket>( io_service_ );
+        attempts_.push_back( socket );
+        ++pending_attempts_;
+        LL("%s: connecting to %s", nickname_.c_str(), endpoint.address().to_string().c_str());
+        socket->async_connect( endpoint, [this, socket, generation = connect_generation_]( std::error_code ec ) {
+                if( generation != connect_generation_ ) {
+                    return;
+                }
+                --pending_attempts_;
+                if( ec ) {
+                    LL("%s: connect error: %s", nickname_.c_str(), ec.message().c_str());
+                    if( next_endpoint_ < endpoints_.size() ) {
+                        start_attempt();
+                    } else if( !pending_attempts_ ) {
+                        connect_failed();
+                    }
+                    return;
+                }
+                socket_ = std::move( *socket );
+                stop_attempts();
+                stop_connection_timer();
+                connected();
+            } );
+        attempt_timer_.expires_from_now( boost::posix_time::milliseconds( int(ATTEMPT_MILLISECONDS) ) );
+        attempt_timer_.async_wait( [this, generation = connect_generation_]( const boost::system::error_code& ec ) {
+                if( !ec && generation == connect_generation_ ) {
+                    start_attempt();
+                }
+            } );
+    }
+    // cancels the resolver and every connection attempt still in flight
+    void stop_attempts()
+    {
+        ++connect_generation_;
+        resolver_.cancel();
+        attempt_timer_.cancel();
+        for( auto& socket: attempts_ ) {
+            boost::system::error_code ec;
+            socket->close( ec );
+        }
+        attempts_.clear();
+    }
+    void connect_failed()
+    {
+        stop_attempts();
+        stop_connection_timer();
+        reconnect();
+    }
+    void connected()
+    {
+        LL("%s: connected", nickname_.c_str());
+        connected_ = true;
+        while( messages_to_send_.size() && ( messages_to_send_.front().type() == MessageBody::ADD
+                                             || messages_to_send_.front().type() == MessageBody::RESUME ) ) {
+            messages_to_send_.pop_front();
+        }
+        if( token_.empty() ) {
+            messages_to_send_.push_front( AddMessage( nickname_, reliable_ ) );
+        } else {
+            messages_to_send_.push_front( ResumeMessage( nickname_, token_, received_frames_, reliable_ ) );
+        }
+        if( !sending_ ) {
+            send_message();
+        }
+        receive_input();
+        receive_message_header();
     }
     void receive_input()
     {
+        if( receiving_input_ ) {
+            return;
+        }
         LL("%s: waiting for input...", nickname_.c_str());
+        receiving_input_ = true;
         boost::asio::async_read_until( input_, input_buffer_, '\n',
                                 [this]( const boost::system::error_code ec, size_t size )
                                 {
                                     LL("%s: got input", nickname_.c_str());
+                                    receiving_input_ = false;
                                     process_input( ec, size );
                                 }
             );
@@ -116,7 +238,7 @@ private:
                                   receive_message_body();
                               } else {
                                   LL("%s: receive header error: %s", nickname_.c_str(), ec.message().c_str());
-                                  close();
+                                  disconnected();
                               }
                           }
             );
@@ -131,9 +253,10 @@ private:
                               LL("%s: received message body", nickname_.c_str());
                               if( !ec ) {
                                   process_received_message( received_message_ );
+                                  schedule_ack();
                               } else {
                                   LL("%s: receive body error: %s", nickname_.c_str(), ec.message().c_str());
-                                  close();
+                                  disconnected();
                               }
                           }
             );
@@ -143,31 +266,73 @@ private:
         LL("%s: send message", nickname_.c_str());
         if( !message.serialized() ) {
             LL("%s: message is skipped", nickname_.c_str());
-            io_service_.post(
-                [this]()
-                {
-                    receive_input();
-                }
-                );
             return;
         }
+        messages_to_send_.push_back( message );
+        if( connected_ && !sending_ ) {
+            send_message();
+        }
+    }
+    void send_message()
+    {
+        auto& message = messages_to_send_.front();
+        if( reliable_ && message.type() != MessageBody::ADD ) {
+            message.acknowledge( received_frames_ );
+            acked_frames_ = received_frames_;
+        }
         LL("%s: message to send (%s,%d)", nickname_.c_str(), message.data(), message.size());
+        sending_ = true;
         boost::asio::async_write( socket_,
                            boost::asio::buffer( message.data(), message.size() ),
                            [this]( std::error_code ec, size_t )
                            {
                                LL("%s: message sent", nickname_.c_str());
+                               sending_ = false;
                                if( !ec ) {
-                                   receive_input();
+                                   messages_to_send_.pop_front();
+                                   if( connected_ && messages_to_send_.size() ) {
+                                       send_message();
+                                   }
                                } else {
                                    LL("%s: send message error: %s", nickname_.c_str(), ec.message().c_str());
-                                   close();
+                                   disconnected();
                                }
                            }
             );
     }
+    // Acknowledgements ride on outgoing messages; a bare ACK is sent only
+    // after ACK_FRAMES unacknowledged frames or ACK_MILLISECONDS of silence.
+    void schedule_ack()
+    {
+        if( !reliable_ || received_frames_ <= acked_frames_ ) {
+            return;
+        }
+        if( received_frames_ - acked_frames_ >= ACK_FRAMES ) {
+            send_ack();
+        } else if( !ack_scheduled_ ) {
+            ack_scheduled_ = true;
+            ack_timer_.expires_from_now( boost::posix_time::milliseconds( int(ACK_MILLISECONDS) ) );
+            ack_timer_.async_wait( [this]( const boost::system::error_code& ec ) {
+                    ack_scheduled_ = false;
+                    if( !ec ) {
+                        send_ack();
+                    }
+                } );
+        }
+    }
+    void send_ack()
+    {
+        if( received_frames_ > acked_frames_ && messages_to_send_.empty() ) {
+            LL("%s: acknowledge %llu", nickname_.c_str(), (unsigned long long)received_frames_);
+            send_message( AckMessage( nickname_, received_frames_ ) );
+        }
+    }
     void process_received_message( Message &message )
     {
+        ++received_frames_;
+        // the server answered, so the next connection loss starts the
+        // backoff over, whether this connection was new or resumed
+        retries_ = 0;
         if( !message.parse() )
         {
             LL("%s: message parse error", nickname_.c_str());
@@ -176,20 +341,78 @@ private:
         std::string message_to_output;
         switch( message.type() )
         {
+            case MessageBody::SESSION:
+                LL("%s: session token received", nickname_.c_str());
+                token_ = message.token();
+                received_frames_ = message.sequence();
+                roster_.clear();
+                break;
             case MessageBody::ADD:
                 message_to_output = message.nickname() + " joined the chat\n";
                 break;
+            case MessageBody::PRESENCE: {
+                auto& body = message.message_body();
+                for( auto id: body.disconnected() ) {
+                    message_to_output += roster_[id] + " left the chat, connection lost\n";
+                    roster_.erase( id );
+                }
+                for( auto id: body.inactive() ) {
+                    message_to_output += roster_[id] + " left the chat due inactivity\n";
+                    roster_.erase( id );
+                }
+                for( int i = 0; i < body.joined_size() && i < body.joined_id_size(); ++i ) {
+                    roster_[body.joined_id( i )] = body.joined( i );
+                    if( body.joined( i ) != nickname_ ) {
+                        message_to_output += body.joined( i ) + " joined the chat\n";
+                    }
+                }
+                break;
+            }
+            case MessageBody::ROSTER: {
+                std::vector<Roster::Entry> entries;
+                if( !Roster::decode( message.message_body().roster(), entries ) ) {
+                    LL("%s: roster decode error", nickname_.c_str());
+                }
+                for( auto& entry: entries ) {
+                    roster_[entry.id] = entry.nickname;
+                    message_to_output += ( message_to_output.empty() ? "online: " : ", " ) + entry.nickname;
+                }
+                if( message_to_output.size() ) {
+                    message_to_output += "\n";
+                }
+                break;
+            }
             case MessageBody::INACTIVITY:
+                if( message.nickname() == nickname_ ) {
+                    token_.clear();
+                }
                 message_to_output = message.nickname() + " left the chat due inactivity\n";
                 break;
             case MessageBody::DUPLICATE:
+                token_.clear();
                 message_to_output = "nickname '" + message.nickname() + "' already exists\n";
                 break;
             case MessageBody::DISCONNECTED:
                 message_to_output = message.nickname() + " left the chat, connection lost\n";
                 break;
+            case MessageBody::SHUTDOWN:
+                message_to_output = "server is shutting down\n";
+                retry_after_ = message.retry_milliseconds();
+                break;
             case MessageBody::TEXT:
-                message_to_output = message.nickname() + ": " + message.text();
+                if( !message.recipient().empty() ) {
+                    message_to_output = "(private) " + message.nickname() + ": " + message.text();
+                } else if( message.room().empty() ) {
+                    message_to_output = message.nickname() + ": " + message.text();
+                } else {
+                    message_to_output = "[" + message.room() + "] " + message.nickname() + ": " + message.text();
+                }
+                break;
+            case MessageBody::JOIN:
+                message_to_output = message.nickname() + " joined room " + message.room() + "\n";
+                break;
+            case MessageBody::LEAVE:
+                message_to_output = message.nickname() + " left room " + message.room() + "\n";
                 break;
             default:
                 assert(true);   // no way
@@ -216,13 +439,65 @@ private:
             std::string text( buffer, size );
             if( ec )
                 text += '\n';
-            auto message = TextMessage ( nickname_, text );
-            send_message( message );
+            send_message( make_message( text ) );
+            receive_input();
         } else {
             LL("%s: process input error: %s", nickname_.c_str(), ec.message().c_str());
             close();
         }
     }
+    Message make_message( const std::string& text )
+    {
+        const std::string join = "/join ";
+        const std::string leave = "/leave";
+        const std::string direct = "/msg ";
+        const std::string history = "/history ";
+        if( text.compare( 0, join.size(), join ) == 0 ) {
+            auto room = text.substr( join.size() );
+            room.erase( room.find_last_not_of( " \r\n" ) + 1 );
+            room_ = room;
+            LL("%s: join room %s", nickname_.c_str(), room_.c_str());
+            return JoinMessage( nickname_, room_ );
+        }
+        if( text.compare( 0, leave.size(), leave ) == 0 ) {
+            LL("%s: leave room %s", nickname_.c_str(), room_.c_str());
+            auto room = room_;
+            room_.clear();
+            return LeaveMessage( nickname_, room );
+        }
+        if( text.compare( 0, direct.size(), direct ) == 0 ) {
+            auto separator = text.find( ' ', direct.size() );
+            if( separator != std::string::npos ) {
+                auto recipient = text.substr( direct.size(), separator - direct.size() );
+                LL("%s: direct message to %s", nickname_.c_str(), recipient.c_str());
+                return DirectMessage( nickname_, recipient, text.substr( separator + 1 ) );
+            }
+        }
+        if( text.compare( 0, history.size(), history ) == 0 ) {
+            using namespace std::chrono;
+            auto minutes = std::strtoull( text.c_str() + history.size(), nullptr, 10 );
+            auto now = duration_cast<milliseconds>( system_clock::now().time_since_epoch() ).count();
+            LL("%s: history for %llu minutes", nickname_.c_str(), minutes);
+            return HistoryMessage( nickname_, now - minutes * 60 * 1000 );
+        }
+        return TextMessage( nickname_, text, room_ );
+    }
+    // a session that got a token is resumed on a new connection
+    void disconnected()
+    {
+        if( token_.empty() ) {
+            close();
+            return;
+        }
+        if( !connected_ ) {
+            return;
+        }
+        LL("%s: connection lost", nickname_.c_str());
+        connected_ = false;
+        acked_frames_ = 0;
+        socket_.close();
+        reconnect();
+    }
     void close()
     {
         LL("%s: close client", nickname_.c_str());
@@ -233,15 +508,42 @@ private:
     }
 
     boost::asio::io_service& io_service_;
-    tcp::socket socket_;
+    // TCP or Unix domain stream socket
+    boost::asio::generic::stream_protocol::socket socket_;
+    std::string address_;
+    std::string port_;
+    std::string unix_path_;
+    tcp::resolver resolver_;
+    // connection attempts of the current connect, see connect()
+    std::vector<tcp::endpoint> endpoints_;
+    size_t next_endpoint_ = 0;
+    size_t pending_attempts_ = 0;
+    std::vector<std::shared_ptr<tcp::socket> > attempts_;
+    unsigned connect_generation_ = 0;
     Message received_message_;
+    std::deque<Message> messages_to_send_;
+    bool sending_ = false;
     std::string nickname_;
+    bool reliable_;
+    std::string room_;
+    std::string token_;
+    // roster id -> nickname of everyone online
+    std::unordered_map<uint32_t, std::string> roster_;
+    uint64_t received_frames_ = 0;
+    uint64_t acked_frames_ = 0;
+    bool ack_scheduled_ = false;
+    bool connected_ = false;
+    unsigned retries_ = 0;
+    uint64_t retry_after_ = 0;
+    std::mt19937 random_{ std::random_device{}() };
+    bool receiving_input_ = false;
     boost::asio::posix::stream_descriptor input_;
     boost::asio::posix::stream_descriptor output_;
     boost::asio::streambuf input_buffer_;
     boost::asio::deadline_timer connection_timer_;
     boost::asio::deadline_timer retry_timer_;
-    tcp::resolver::iterator endpoint_iterator_;
+    boost::asio::deadline_timer attempt_timer_;
+    boost::asio::deadline_timer ack_timer_;
 };
 
 int main( int argc, char *argv[] )
@@ -250,14 +552,25 @@ int main( int argc, char *argv[] )
     std::string address;
     std::string port;
     std::string nickname;
-    app.add_option("-a,--address", address, "address to connect")->required();
-    app.add_option("-p,--port", port, "port to connect")->required();
+    std::string unix_path;
+    app.add_option("-a,--address", address, "address to connect");
+    app.add_option("-p,--port", port, "port to connect");
+    app.add_option("-u,--unix", unix_path, "Unix domain socket of a server on this host");
     app.add_option("-n,--nickname", nickname, "nickname")->required();
+    bool reliable = false;
+    app.add_flag("-r,--reliable", reliable, "acknowledge received messages so none are lost on reconnect");
     CLI11_PARSE(app, argc, argv);
+    if( unix_path.empty() && ( address.empty() || port.empty() ) ) {
+        return app.exit( CLI::RequiredError( "--address and --port or --unix" ) );
+    }
+    if( nickname.size() > Roster::MAX_NICKNAME_SIZE ) {
+        return app.exit( CLI::ValidationError( "--nickname", "longer than "
+                                               + std::to_string( Roster::MAX_NICKNAME_SIZE ) + " bytes" ) );
+    }
 
     try {
         boost::asio::io_service io_service;
-        Client client( io_service, address, port, nickname );
+        Client client( io_service, address, port, unix_path, nickname, reliable );
         io_service.run();
     }
     catch( std::exception& e ) {
@@ -0,0 +1,244 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "CLI11.hpp"
+#include "message.pb.h"
+#include "Message.hpp"
+
+// Fan-out benchmark: one sender broadcasts messages to many receivers
+// through a running server, as fast as the slowest receiver keeps up, and
+// reports deliveries per second and the server's CPU time per delivery.
+// The server needs --rate 0 and an --idle-seconds longer than the run.
+
+// user and system CPU time of a process in seconds, negative if unknown
+static double cpu_seconds( int pid )
+{
+    std::ifstream stat( "/proc/" + std::to_string( pid ) + "/stat" );
+    std::string line;
+    if( !std::getline( stat, line ) ) {
+        return -1;
+    }
+    // fields after the command name, which may contain spaces
+    auto end = line.rfind( ')' );
+    if( end == std::string::npos ) {
+        return -1;
+    }
+    std::istringstream fields( line.substr( end + 2 ) );
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+    for( int i = 3; i <= 15 && fields >> field; ++i ) {
+        if( i == 14 ) {
+            utime = std::strtoull( field.c_str(), nullptr, 10 );
+        } else if( i == 15 ) {
+            stime = std::strtoull( field.c_str(), nullptr, 10 );
+        }
+    }
+    return double( utime + stime ) / ::sysconf( _SC_CLK_TCK );
+}
+
+static int open_connection( const sockaddr_in& server )
+{
+    int fd = ::socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) {
+        return -1;
+    }
+    if( ::connect( fd, reinterpret_cast<const sockaddr*>( &server ), sizeof server ) < 0 ) {
+        ::close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all( int fd, const Message& message )
+{
+    return ::send( fd, message.data(), message.size(), MSG_NOSIGNAL ) == ssize_t( message.size() );
+}
+
+// Frames arriving on one receiving connection; counts the TEXT frames
+// from the sender.
+struct Receiver {
+    int fd = -1;
+    std::string input;
+    size_t received = 0;
+
+    bool read( const std::string& sender )
+    {
+        char buffer[64 * 1024];
+        auto size = ::recv( fd, buffer, sizeof buffer, 0 );
+        if( size <= 0 ) {
+            return size < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK );
+        }
+        input.append( buffer, size );
+        size_t offset = 0;
+        MessageBody body;
+        while( input.size() - offset >= Message::HEADER_SIZE ) {
+            size_t body_size = 0;
+            sscanf( input.c_str() + offset, "%3lu", &body_size );
+            if( input.size() - offset < Message::HEADER_SIZE + body_size ) {
+                break;
+            }
+            if( body.ParseFromArray( input.data() + offset + Message::HEADER_SIZE, body_size )
+                && body.type() == MessageBody::TEXT && body.nickname() == sender ) {
+                ++received;
+            }
+            offset += Message::HEADER_SIZE + body_size;
+        }
+        input.erase( 0, offset );
+        return true;
+    }
+};
+
+int main( int argc, char *argv[] )
+{
+    CLI::App app("Broadcast fan-out benchmark");
+    std::string address = "127.0.0.1";
+    int port = 0;
+    int pid = 0;
+    size_t receivers_count = 100;
+    size_t count = 10000;
+    size_t window = 256;
+    unsigned settle_milliseconds = 1000;
+    unsigned timeout_seconds = 60;
+    app.add_option("-a,--address", address, "IPv4 address of the server", true);
+    app.add_option("-p,--port", port, "port of the server")->required();
+    app.add_option("--pid", pid, "process id of the server, for its CPU time");
+    app.add_option("-r,--receivers", receivers_count, "receiving connections", true);
+    app.add_option("-n,--messages", count, "messages broadcast", true);
+    app.add_option("--window", window, "messages sent ahead of the slowest receiver", true);
+    app.add_option("--settle-ms", settle_milliseconds, "wait for joins before sending", true);
+    app.add_option("--timeout-seconds", timeout_seconds, "give up after", true);
+    CLI11_PARSE(app, argc, argv);
+
+    rlimit limit;
+    if( ::getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < limit.rlim_max ) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit( RLIMIT_NOFILE, &limit );
+    }
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons( port );
+    if( ::inet_pton( AF_INET, address.c_str(), &server.sin_addr ) != 1 ) {
+        std::cerr << "bad address " << address << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Receiver> receivers( receivers_count );
+    for( size_t i = 0; i < receivers.size(); ++i ) {
+        receivers[i].fd = open_connection( server );
+        if( receivers[i].fd < 0 || !send_all( receivers[i].fd, AddMessage( "fanout" + std::to_string( i ) ) ) ) {
+            std::cerr << "receiver " << i << " failed: " << strerror( errno ) << std::endl;
+            return EXIT_FAILURE;
+        }
+        ::fcntl( receivers[i].fd, F_SETFL, O_NONBLOCK );
+    }
+    const std::string sender_nickname = "fanout-sender";
+    int sender = open_connection( server );
+    if( sender < 0 || !send_all( sender, AddMessage( sender_nickname ) ) ) {
+        std::cerr << "sender failed: " << strerror( errno ) << std::endl;
+        return EXIT_FAILURE;
+    }
+    ::fcntl( sender, F_SETFL, O_NONBLOCK );
+
+    // presence, roster and history frames of the joins
+    std::vector<pollfd> polled( receivers.size() + 1 );
+    auto settled = std::chrono::steady_clock::now() + std::chrono::milliseconds( settle_milliseconds );
+    while( std::chrono::steady_clock::now() < settled ) {
+        for( size_t i = 0; i < receivers.size(); ++i ) {
+            polled[i] = { receivers[i].fd, POLLIN, 0 };
+        }
+        polled.back() = { sender, POLLIN, 0 };
+        if( ::poll( polled.data(), polled.size(), 10 ) > 0 ) {
+            for( size_t i = 0; i < receivers.size(); ++i ) {
+                if( polled[i].revents ) {
+                    receivers[i].read( sender_nickname );
+                    receivers[i].input.clear();
+                }
+            }
+            char discard[64 * 1024];
+            while( ::recv( sender, discard, sizeof discard, 0 ) > 0 ) {}
+        }
+    }
+
+    auto cpu_before = pid ? cpu_seconds( pid ) : -1;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds( timeout_seconds );
+    size_t sent = 0;
+    std::string output;
+    size_t output_offset = 0;
+    size_t slowest = 0;
+    while( slowest < count ) {
+        if( std::chrono::steady_clock::now() > deadline ) {
+            std::cerr << "timed out with " << slowest << " of " << count << " messages at every receiver" << std::endl;
+            return EXIT_FAILURE;
+        }
+        bool sending = output_offset < output.size() || ( sent < count && sent - slowest < window );
+        for( size_t i = 0; i < receivers.size(); ++i ) {
+            polled[i] = { receivers[i].fd, POLLIN, 0 };
+        }
+        polled.back() = { sender, short( sending ? POLLIN | POLLOUT : POLLIN ), 0 };
+        if( ::poll( polled.data(), polled.size(), 100 ) <= 0 ) {
+            continue;
+        }
+        for( size_t i = 0; i < receivers.size(); ++i ) {
+            if( polled[i].revents && !receivers[i].read( sender_nickname ) ) {
+                std::cerr << "receiver " << i << " disconnected" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        if( polled.back().revents & POLLIN ) {
+            char discard[64 * 1024];
+            while( ::recv( sender, discard, sizeof discard, 0 ) > 0 ) {}
+        }
+        if( polled.back().revents & POLLOUT ) {
+            if( output_offset == output.size() ) {
+                output.clear();
+                output_offset = 0;
+                for( ; sent < count && sent - slowest < window && output.size() < 16 * 1024; ++sent ) {
+                    TextMessage message( sender_nickname, "m" + std::to_string( sent ) );
+                    output.append( message.data(), message.size() );
+                }
+            }
+            auto size = ::send( sender, output.data() + output_offset, output.size() - output_offset, MSG_NOSIGNAL );
+            if( size > 0 ) {
+                output_offset += size;
+            } else if( size < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+                std::cerr << "sender disconnected: " << strerror( errno ) << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        slowest = count;
+        for( auto& receiver: receivers ) {
+            slowest = std::min( slowest, receiver.received );
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    auto cpu_after = pid ? cpu_seconds( pid ) : -1;
+
+    double deliveries = double( count ) * receivers.size();
+    std::cout << "receivers: " << receivers.size() << ", messages: " << count << std::endl
+              << "elapsed: " << elapsed.count() << " s" << std::endl
+              << "deliveries per second: " << uint64_t( deliveries / elapsed.count() ) << std::endl;
+    if( cpu_before >= 0 && cpu_after >= 0 ) {
+        std::cout << "server cpu: " << cpu_after - cpu_before << " s, "
+                  << uint64_t( ( cpu_after - cpu_before ) * 1e9 / deliveries ) << " ns per delivery" << std::endl;
+    }
+    for( auto& receiver: receivers ) {
+        ::close( receiver.fd );
+    }
+    ::close( sender );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "CLI11.hpp"
+#include "message.pb.h"
+#include "Message.hpp"
+
+// Idle connection benchmark: opens many connections to a running server,
+// leaves them idle and reports how much the server's resident memory grew
+// per connection. The server needs an open file limit above the number of
+// connections and an --idle-seconds longer than the run.
+
+// resident set size of a process in bytes, 0 if unknown
+static size_t resident_bytes( int pid )
+{
+    std::ifstream status( "/proc/" + std::to_string( pid ) + "/status" );
+    std::string line;
+    while( std::getline( status, line ) ) {
+        if( line.compare( 0, 6, "VmRSS:" ) == 0 ) {
+            std::istringstream fields( line.substr( 6 ) );
+            size_t kilobytes = 0;
+            fields >> kilobytes;
+            return kilobytes * 1024;
+        }
+    }
+    return 0;
+}
+
+// loopback connections are spread over source addresses, a single one
+// runs out of ephemeral ports
+enum { CONNECTIONS_PER_SOURCE = 20000 };
+
+static int open_connection( const sockaddr_in& server, size_t index )
+{
+    int fd = ::socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) {
+        return -1;
+    }
+    if( ( ntohl( server.sin_addr.s_addr ) >> 24 ) == 127 ) {
+        sockaddr_in source{};
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl( 0x7f000001 + index / CONNECTIONS_PER_SOURCE );
+        if( ::bind( fd, reinterpret_cast<sockaddr*>( &source ), sizeof source ) < 0 ) {
+            ::close( fd );
+            return -1;
+        }
+    }
+    if( ::connect( fd, reinterpret_cast<const sockaddr*>( &server ), sizeof server ) < 0 ) {
+        ::close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+int main( int argc, char *argv[] )
+{
+    CLI::App app("Idle connection memory benchmark");
+    std::string address = "127.0.0.1";
+    int port = 0;
+    int pid = 0;
+    size_t count = 100000;
+    unsigned settle_milliseconds = 2000;
+    bool join = false;
+    size_t max_bytes = 0;
+    app.add_option("-a,--address", address, "IPv4 address of the server", true);
+    app.add_option("-p,--port", port, "port of the server")->required();
+    app.add_option("--pid", pid, "process id of the server")->required();
+    app.add_option("-n,--connections", count, "connections to open", true);
+    app.add_option("--settle-ms", settle_milliseconds, "wait before measuring", true);
+    app.add_flag("--join", join, "log every connection in with a nickname");
+    app.add_option("--max-bytes", max_bytes, "fail if a connection costs more, 0 for no limit", true);
+    CLI11_PARSE(app, argc, argv);
+
+    rlimit limit;
+    if( ::getrlimit( RLIMIT_NOFILE, &limit ) == 0 && limit.rlim_cur < limit.rlim_max ) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit( RLIMIT_NOFILE, &limit );
+    }
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons( port );
+    if( ::inet_pton( AF_INET, address.c_str(), &server.sin_addr ) != 1 ) {
+        std::cerr << "bad address " << address << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto before = resident_bytes( pid );
+    std::vector<int> connections;
+    connections.reserve( count );
+    for( size_t i = 0; i < count; ++i ) {
+        int fd = open_connection( server, i );
+        if( fd < 0 ) {
+            std::cerr << "connection " << i << " failed: " << strerror( errno ) << std::endl;
+            break;
+        }
+        if( join ) {
+            AddMessage message( "idle" + std::to_string( i ) );
+            if( ::send( fd, message.data(), message.size(), MSG_NOSIGNAL ) != ssize_t( message.size() ) ) {
+                std::cerr << "connection " << i << " lost" << std::endl;
+            }
+        }
+        connections.push_back( fd );
+    }
+    std::this_thread::sleep_for( std::chrono::milliseconds( settle_milliseconds ) );
+    auto after = resident_bytes( pid );
+    if( !before || !after ) {
+        std::cerr << "cannot read the memory of process " << pid << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t per_connection = connections.empty() || after < before ? 0 : ( after - before ) / connections.size();
+    std::cout << "connections: " << connections.size() << std::endl
+              << "server rss: " << before / 1024 << " kB -> " << after / 1024 << " kB" << std::endl
+              << "per connection: " << per_connection << " bytes" << std::endl;
+    for( int fd: connections ) {
+        ::close( fd );
+    }
+    if( connections.size() < count || ( max_bytes && per_connection > max_bytes ) ) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#include <cstdlib>
+#include <iostream>
+#include "CLI11.hpp"
+#include "Server.hpp"
+
+// Edge relay: serves clients over the chat protocol and links to a
+// core server as one peer. The core sends every frame once per relay,
+// and the relay fans it out to its own clients.
+int main( int argc, char *argv[] )
+{
+    CLI::App app("Chat relay");
+    Config config;
+    std::string upstream;
+    app.add_option("-p,--port", config.port, "port number to listen")->required();
+    app.add_option("--unix", config.unix_path, "also listen on this Unix domain socket");
+    app.add_option("-u,--upstream", upstream, "host:port of the core server's peer port")->required();
+    app.add_option("--history", config.history_count, "number of messages replayed on join", true);
+    app.add_option("--history-bytes", config.history_bytes, "size limit of replayed messages in bytes", true);
+    app.add_option("--idle-seconds", config.inactivity_seconds, "idle time after which a client is disconnected", true);
+    app.add_option("--resume-seconds", config.resume_seconds, "how long a lost session waits for resume", true);
+    app.add_option("--resume-frames", config.resume_frames, "sent frames kept for replay on resume", true);
+    app.add_option("--reliable-window", config.reliable_window, "unacknowledged frames per reliable session", true);
+    app.add_option("--presence-ms", config.presence_milliseconds, "window for batching joins and leaves", true);
+    app.add_option("--rate", config.rate, "messages per second a client may send, 0 for no limit", true);
+    app.add_option("--burst", config.burst, "messages a client may send at once", true);
+    app.add_flag("--io-uring", config.io_uring, "socket I/O through io_uring, falls back to the reactor if unavailable");
+    app.add_option("--uring-entries", config.uring_entries, "io_uring submission queue size", true);
+    app.add_option("--session-pool", config.session_pool, "sessions allocated up front", true);
+    app.add_option("--stats-seconds", config.stats_seconds, "interval for logging allocation counters, 0 for never", true);
+    app.add_option("--node", config.node, "node id in a cluster, random by default");
+    app.add_option("--handoff", config.handoff, "Unix socket for hot restart, taken over if a server listens on it");
+    app.add_option("--drain-ms", config.drain_milliseconds, "time to close all sessions on SIGTERM", true);
+    app.add_option("--drain-batch", config.drain_batch, "sessions closed at a time on SIGTERM", true);
+    app.add_option("--retry-after-ms", config.retry_milliseconds, "reconnect delay advised to clients on shutdown", true);
+    CLI11_PARSE(app, argc, argv);
+    config.peers.push_back( upstream );
+
+    try {
+        boost::asio::io_service io_service;
+        Server server( io_service, config );
+        io_service.run();
+    }
+    catch( std::exception& e ) {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
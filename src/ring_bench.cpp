@@ -0,0 +1,149 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "CLI11.hpp"
+#include "message.pb.h"
+#include "Message.hpp"
+#include "ShmRing.hpp"
+
+// Shared-memory ring benchmark: several producer threads attach to a
+// running server's --ring and push TEXT frames into it while one client
+// connection checks that every frame arrives, in order per producer. It
+// reports frames per second and how often producers found the ring full.
+// The server needs an --idle-seconds longer than the run.
+
+int main( int argc, char *argv[] )
+{
+    CLI::App app("Shared-memory ring producer benchmark");
+    std::string address = "127.0.0.1";
+    int port = 0;
+    std::string ring_path;
+    size_t threads = 4;
+    size_t count = 100000;
+    unsigned settle_milliseconds = 500;
+    unsigned timeout_seconds = 60;
+    app.add_option("-a,--address", address, "IPv4 address of the server", true);
+    app.add_option("-p,--port", port, "port of the server")->required();
+    app.add_option("--ring", ring_path, "ring socket of the server")->required();
+    app.add_option("-t,--threads", threads, "producer threads", true);
+    app.add_option("-n,--messages", count, "messages pushed by each producer", true);
+    app.add_option("--settle-ms", settle_milliseconds, "wait for the join before pushing", true);
+    app.add_option("--timeout-seconds", timeout_seconds, "give up after", true);
+    CLI11_PARSE(app, argc, argv);
+
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons( port );
+    if( ::inet_pton( AF_INET, address.c_str(), &server.sin_addr ) != 1 ) {
+        std::cerr << "bad address " << address << std::endl;
+        return EXIT_FAILURE;
+    }
+    int receiver = ::socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    // names of this run, so history replayed on join is not counted
+    auto prefix = "ring" + std::to_string( ::getpid() ) + "-";
+    AddMessage add( prefix + "check" );
+    if( receiver < 0 || ::connect( receiver, reinterpret_cast<const sockaddr*>( &server ), sizeof server ) < 0
+        || ::send( receiver, add.data(), add.size(), MSG_NOSIGNAL ) != ssize_t( add.size() ) ) {
+        std::cerr << "receiver failed: " << strerror( errno ) << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::unique_ptr<ShmRing> ring;
+    try {
+        ring = ShmRing::attach( ring_path );
+    } catch( const std::exception& e ) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::this_thread::sleep_for( std::chrono::milliseconds( settle_milliseconds ) );
+
+    // the next message expected from every producer
+    std::vector<size_t> expected( threads );
+    size_t received = 0;
+    std::atomic<uint64_t> full( 0 );
+    std::atomic<bool> stopped( false );
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for( size_t t = 0; t < threads; ++t ) {
+        producers.emplace_back( [&ring, &full, &stopped, &prefix, count, t]() {
+                uint64_t retries = 0;
+                for( size_t i = 0; i < count && !stopped; ++i ) {
+                    TextMessage message( prefix + std::to_string( t ), std::to_string( i ) );
+                    while( !ring->push( message ) && !stopped ) {
+                        ++retries;
+                        std::this_thread::yield();
+                    }
+                }
+                full += retries;
+            } );
+    }
+
+    auto deadline = start + std::chrono::seconds( timeout_seconds );
+    std::string input;
+    MessageBody body;
+    bool ordered = true;
+    while( received < threads * count && ordered ) {
+        if( std::chrono::steady_clock::now() > deadline ) {
+            break;
+        }
+        pollfd polled{ receiver, POLLIN, 0 };
+        if( ::poll( &polled, 1, 100 ) <= 0 ) {
+            continue;
+        }
+        char buffer[64 * 1024];
+        auto size = ::recv( receiver, buffer, sizeof buffer, 0 );
+        if( size <= 0 ) {
+            std::cerr << "receiver disconnected" << std::endl;
+            break;
+        }
+        input.append( buffer, size );
+        size_t offset = 0;
+        while( input.size() - offset >= Message::HEADER_SIZE ) {
+            size_t body_size = 0;
+            sscanf( input.c_str() + offset, "%3lu", &body_size );
+            if( input.size() - offset < Message::HEADER_SIZE + body_size ) {
+                break;
+            }
+            if( body.ParseFromArray( input.data() + offset + Message::HEADER_SIZE, body_size )
+                && body.type() == MessageBody::TEXT && body.nickname().compare( 0, prefix.size(), prefix ) == 0 ) {
+                size_t t = std::strtoul( body.nickname().c_str() + prefix.size(), nullptr, 10 );
+                if( t >= threads || body.text() != std::to_string( expected[t] ) ) {
+                    std::cerr << "out of order from " << body.nickname() << ": " << body.text() << std::endl;
+                    ordered = false;
+                    break;
+                }
+                ++expected[t];
+                ++received;
+            }
+            offset += Message::HEADER_SIZE + body_size;
+        }
+        input.erase( 0, offset );
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    // a server that stopped popping leaves the ring full
+    stopped = true;
+    for( auto& producer: producers ) {
+        producer.join();
+    }
+    ::close( receiver );
+
+    std::cout << "producers: " << threads << ", messages: " << threads * count << ", received: " << received << std::endl
+              << "elapsed: " << elapsed.count() << " s" << std::endl
+              << "frames per second: " << uint64_t( received / elapsed.count() ) << std::endl
+              << "pushes on a full ring: " << full << std::endl;
+    if( received < threads * count ) {
+        std::cerr << threads * count - received << " messages missing" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
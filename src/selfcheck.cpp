@@ -0,0 +1,177 @@
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "message.pb.h"
+#include "FrameQueue.hpp"
+#include "LogIndex.hpp"
+#include "Message.hpp"
+#include "Roster.hpp"
+
+// Self-check of the data structures whose edge cases the chat traffic
+// rarely reaches: roster snapshots split over frames, frame queues
+// wrapping around their ring and index lookups at segment boundaries.
+// Exits with a failure status if any check fails.
+
+static int failures = 0;
+
+static void check( bool condition, const std::string& what )
+{
+    if( !condition ) {
+        std::cerr << "failed: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// rosters of names sharing prefixes, sized to cross the frame split at
+// every entry length
+static void check_roster()
+{
+    for( size_t length = 2; length <= 64; ++length ) {
+        std::map<std::string, uint32_t> roster;
+        for( uint32_t id = 0; id < Roster::MAX_ROSTER_SIZE; ++id ) {
+            std::string nickname( length, 'n' );
+            for( uint32_t rest = id * 7, i = length; rest && i--; rest /= 26 ) {
+                nickname[i] = 'a' + rest % 26;
+            }
+            roster[nickname] = id * 131;
+        }
+        auto frames = Roster::encode( roster );
+        std::vector<Roster::Entry> entries;
+        for( auto& frame: frames ) {
+            check( frame->size() <= Message::HEADER_SIZE + Message::MAX_BODY_SIZE, "roster frame size" );
+            Message message;
+            memcpy( message.data(), frame->data(), frame->size() );
+            check( message.get_header() && message.parse() && message.type() == MessageBody::ROSTER
+                   && Roster::decode( message.message_body().roster(), entries ),
+                   "roster frame of " + std::to_string( length ) + " byte names decodes" );
+        }
+        check( frames.size() > 1, "roster of " + std::to_string( length ) + " byte names spans frames" );
+        check( entries.size() == roster.size(), "roster of " + std::to_string( length ) + " byte names round-trips" );
+        auto entry = entries.begin();
+        for( auto& member: roster ) {
+            if( entry == entries.end() ) {
+                break;
+            }
+            check( entry->nickname == member.first && entry->id == member.second, "roster entry " + member.first );
+            ++entry;
+        }
+    }
+    // the longest names, with the longest ids, each get a frame of their own
+    std::map<std::string, uint32_t> roster{ { std::string( Roster::MAX_NICKNAME_SIZE, 'x' ), UINT32_MAX },
+                                            { std::string( Roster::MAX_NICKNAME_SIZE, 'y' ), UINT32_MAX - 1 } };
+    check( Roster::encode( roster ).size() == 2, "longest names in frames of their own" );
+}
+
+// random pushes and pops at both ends against std::deque
+static void check_frame_queue()
+{
+    std::mt19937 random( 1 );
+    FrameQueue queue;
+    std::deque<std::string> model;
+    for( int step = 0; step < 100000; ++step ) {
+        // bursts past SHRINK_CAPACITY and back to empty
+        bool growing = step / 500 % 2 == 0;
+        auto operation = random() % 4;
+        if( model.empty() || ( growing ? operation < 3 : operation == 0 ) ) {
+            auto text = std::to_string( step );
+            if( random() % 2 ) {
+                queue.push_back( make_frame( text.data(), text.size() ) );
+                model.push_back( text );
+            } else {
+                queue.push_front( make_frame( text.data(), text.size() ) );
+                model.push_front( text );
+            }
+        } else if( random() % 2 ) {
+            queue.pop_front();
+            model.pop_front();
+        } else {
+            queue.pop_back();
+            model.pop_back();
+        }
+        if( queue.size() != model.size() ) {
+            check( false, "frame queue size at step " + std::to_string( step ) );
+            return;
+        }
+        size_t index = 0;
+        for( auto& frame: queue ) {
+            if( std::string( frame->data(), frame->size() ) != model[index++] ) {
+                check( false, "frame queue order at step " + std::to_string( step ) );
+                return;
+            }
+        }
+    }
+}
+
+static void write_index( const std::string& log_path, const std::vector<LogIndex::Entry>& entries )
+{
+    std::ofstream sidecar( LogIndex::index_path( log_path ), std::ios::binary );
+    sidecar.write( reinterpret_cast<const char*>( entries.data() ), entries.size() * sizeof( LogIndex::Entry ) );
+}
+
+static void check_find( const LogIndex& index, uint64_t timestamp, const std::string& path, uint64_t offset )
+{
+    LogIndex::Position position;
+    check( index.find( timestamp, position ) && position.path == path && position.offset == offset,
+           "find " + std::to_string( timestamp ) + " at " + path + ":" + std::to_string( offset ) );
+}
+
+// a scan from the found position must reach every record at or after the
+// timestamp, including records of the same millisecond before the entry
+static void check_log_index()
+{
+    char directory[] = "/tmp/selfcheck.XXXXXX";
+    if( !::mkdtemp( directory ) ) {
+        check( false, "temporary directory" );
+        return;
+    }
+    std::string first = std::string( directory ) + "/0.log";
+    std::string second = std::string( directory ) + "/3.log";
+    std::string third = std::string( directory ) + "/5.log";
+    write_index( first, { { 0, 10, 0 }, { 1, 20, 100 }, { 2, 30, 200 } } );
+    {
+        LogIndex index;
+        LogIndex::Position position;
+        check( !index.find( 10, position ), "find in an empty index" );
+        index.map_segment( first );
+        index.open_segment( second );
+        index.append( { 3, 30, 0 } );
+        index.append( { 4, 40, 100 } );
+        check_find( index, 5, first, 0 );
+        check_find( index, 10, first, 0 );
+        check_find( index, 15, first, 0 );
+        check_find( index, 20, first, 0 );
+        check_find( index, 25, first, 100 );
+        check_find( index, 30, first, 100 );
+        check_find( index, 35, second, 0 );
+        check_find( index, 40, second, 0 );
+        check_find( index, 50, second, 100 );
+        // the writer has started a segment but indexed nothing in it
+        index.open_segment( third );
+        check_find( index, 50, second, 100 );
+        check( index.next( first ) == second && index.next( second ) == third && index.next( third ).empty(),
+               "segments in order" );
+    }
+    for( auto& path: { first, second, third } ) {
+        ::unlink( LogIndex::index_path( path ).c_str() );
+    }
+    ::rmdir( directory );
+}
+
+int main()
+{
+    check_roster();
+    check_frame_queue();
+    check_log_index();
+    if( failures ) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}